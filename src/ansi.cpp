@@ -0,0 +1,283 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#include <lol/engine.h>
+
+#include "ansi.h"
+
+namespace z8
+{
+
+static int const ansi_palette[] =
+{
+     16, // 000000 → 000000
+     17, // 1d2b53 → 00005f
+     89, // 7e2553 → 87005f
+     29, // 008751 → 00875f
+    131, // ab5236 → ab5236
+    240, // 5f574f → 5f5f5f
+    251, // c2c3c7 → c6c6c6
+    230, // fff1e8 → ffffdf
+    197, // ff004d → ff005f
+    214, // ffa300 → ffaf00
+    220, // ffec27 → ffdf00
+     47, // 00e436 → 00ff5f
+     39, // 29adff → 00afff
+    103, // 83769c → 8787af
+    211, // ff77a8 → f787af
+    223, // ffccaa → ffdfaf
+};
+
+// Colour changes: foreground, background, or foreground then background
+// as “\x1b[38;5;<fg>;48;5;<bg>m”; costs are computed from their lengths
+static char const sgr_fg[] = "\x1b[38;5;";
+static char const sgr_bg[] = "\x1b[48;5;";
+static char const sgr_and_bg[] = ";48;5;";
+static char const sgr_end[] = "m";
+
+// Length of the decimal representation of n
+static inline int digits(int n)
+{
+    return n >= 100 ? 3 : n >= 10 ? 2 : 1;
+}
+
+ansi::ansi(lol::ivec2 term_size)
+  : m_term_size(term_size),
+    m_valid(false)
+{
+}
+
+void ansi::resize(lol::ivec2 term_size)
+{
+    m_term_size = term_size;
+    m_valid = false;
+}
+
+void ansi::put(char const *str)
+{
+    while (*str)
+        m_buffer << (uint8_t)*str++;
+}
+
+void ansi::put(int n)
+{
+    if (n >= 10)
+        put(n / 10);
+    m_buffer << (uint8_t)('0' + n % 10);
+}
+
+// Choose how to draw a cell given the current colours: a space or a
+// full block for single colour cells, otherwise whichever of ▀ and ▄
+// needs the fewest colour changes. Update fg and bg accordingly and
+// return the number of bytes needed.
+static int choose_cell(int top, int bottom, int &fg, int &bg,
+                       char const **glyph)
+{
+    int newfg = fg, newbg = bg;
+
+    if (top == bottom)
+    {
+        *glyph = bg == top || fg != top ? " " : "█";
+        if (bg != top && fg != top)
+            newbg = top;
+    }
+    else
+    {
+        bool fg_top = fg == top || bg == bottom;
+        *glyph = fg_top ? "▀" : "▄";
+        newfg = fg_top ? top : bottom;
+        newbg = fg_top ? bottom : top;
+    }
+
+    int cost = (int)strlen(*glyph);
+    if (newfg != fg && newbg != bg)
+        cost += (int)(sizeof(sgr_fg) - 1 + sizeof(sgr_and_bg) - 1 + sizeof(sgr_end) - 1)
+              + digits(ansi_palette[newfg]) + digits(ansi_palette[newbg]);
+    else if (newfg != fg)
+        cost += (int)(sizeof(sgr_fg) - 1 + sizeof(sgr_end) - 1) + digits(ansi_palette[newfg]);
+    else if (newbg != bg)
+        cost += (int)(sizeof(sgr_bg) - 1 + sizeof(sgr_end) - 1) + digits(ansi_palette[newbg]);
+
+    fg = newfg;
+    bg = newbg;
+    return cost;
+}
+
+void ansi::put_cell(int top, int bottom)
+{
+    char const *glyph;
+    int oldfg = m_fg, oldbg = m_bg;
+    choose_cell(top, bottom, m_fg, m_bg, &glyph);
+
+    if (m_fg != oldfg && m_bg != oldbg)
+    {
+        put(sgr_fg); put(ansi_palette[m_fg]);
+        put(sgr_and_bg); put(ansi_palette[m_bg]); put(sgr_end);
+    }
+    else if (m_fg != oldfg)
+    {
+        put(sgr_fg); put(ansi_palette[m_fg]); put(sgr_end);
+    }
+    else if (m_bg != oldbg)
+    {
+        put(sgr_bg); put(ansi_palette[m_bg]); put(sgr_end);
+    }
+
+    put(glyph);
+    ++m_cursor.x;
+}
+
+// Move the cursor to cell (x,y) using the shortest escape sequence
+void ansi::move_to(int x, int y)
+{
+    if (m_cursor.y == y && m_cursor.x == x)
+        return;
+
+    if (m_cursor.y == y && m_cursor.x < x)
+    {
+        // Cursor forward: “\x1b[nC”, or “\x1b[C” for one cell
+        put("\x1b[");
+        if (x - m_cursor.x > 1)
+            put(x - m_cursor.x);
+        put("C");
+    }
+    else
+    {
+        // Cursor position: “\x1b[y;xH”, or “\x1b[yH” for the first column
+        put("\x1b[");
+        put(y + 1);
+        if (x > 0)
+        {
+            put(";");
+            put(x + 1);
+        }
+        put("H");
+    }
+
+    m_cursor = lol::ivec2(x, y);
+}
+
+lol::array<uint8_t> const &ansi::encode(vm const &vm)
+{
+    m_buffer.empty();
+
+    uint8_t const *screen = vm.get_mem(OFFSET_SCREEN);
+    uint8_t const *pal = vm.get_display_pal();
+
+    int width = lol::min(128, m_term_size.x);
+    int height = lol::min(64, m_term_size.y);
+
+    // On a full redraw, reset the terminal state and hide the cursor
+    if (!m_valid)
+    {
+        put("\x1b[0m\x1b[2J\x1b[?25l");
+        m_cursor = lol::ivec2(-1, -1);
+        m_fg = m_bg = -1;
+    }
+
+    for (int y = 0; y < height; ++y)
+    {
+        // Compute the cells of this row in display colours
+        uint8_t cells[128];
+        for (int x = 0; x < width; ++x)
+        {
+            int shift = 4 * (x & 1);
+            int top = (screen[y * 128 + x / 2] >> shift) & 0xf;
+            int bottom = (screen[y * 128 + 64 + x / 2] >> shift) & 0xf;
+            cells[x] = pal[top] | (pal[bottom] << 4);
+        }
+
+        for (int x = 0; x < width; ++x)
+        {
+            if (m_valid && cells[x] == m_cells[y][x])
+                continue;
+
+            // If the cursor is on this row, redrawing the unchanged cells
+            // in between may be cheaper than jumping over them.
+            if (m_cursor.y == y && m_cursor.x < x)
+            {
+                int jump = x - m_cursor.x > 1 ? 3 + digits(x - m_cursor.x) : 3;
+                int redraw = 0, fg = m_fg, bg = m_bg;
+                char const *glyph;
+                for (int i = m_cursor.x; i < x && redraw <= jump; ++i)
+                    redraw += choose_cell(m_cells[y][i] & 0xf,
+                                          m_cells[y][i] >> 4, fg, bg, &glyph);
+
+                if (redraw <= jump)
+                    while (m_cursor.x < x)
+                        put_cell(m_cells[y][m_cursor.x] & 0xf,
+                                 m_cells[y][m_cursor.x] >> 4);
+            }
+
+            move_to(x, y);
+            put_cell(cells[x] & 0xf, cells[x] >> 4);
+            m_cells[y][x] = cells[x];
+        }
+    }
+
+    m_valid = true;
+    return m_buffer;
+}
+
+lol::array<uint8_t> const &ansi::keyframe()
+{
+    m_buffer.empty();
+
+    // Without a previous frame, the next encode() is a full redraw anyway
+    if (!m_valid)
+        return m_buffer;
+
+    lol::ivec2 cursor = m_cursor;
+    int fg = m_fg, bg = m_bg;
+
+    put("\x1b[0m\x1b[2J\x1b[?25l");
+    m_cursor = lol::ivec2(-1, -1);
+    m_fg = m_bg = -1;
+
+    int width = lol::min(128, m_term_size.x);
+    int height = lol::min(64, m_term_size.y);
+
+    for (int y = 0; y < height; ++y)
+    {
+        move_to(0, y);
+        for (int x = 0; x < width; ++x)
+            put_cell(m_cells[y][x] & 0xf, m_cells[y][x] >> 4);
+    }
+
+    // Restore the colours and cursor position of the previous frame
+    if (fg != m_fg || bg != m_bg)
+    {
+        if (fg < 0 || bg < 0)
+            put("\x1b[0m");
+        if (fg >= 0)
+        {
+            put("\x1b[38;5;"); put(ansi_palette[fg]); put("m");
+        }
+        if (bg >= 0)
+        {
+            put("\x1b[48;5;"); put(ansi_palette[bg]); put("m");
+        }
+    }
+
+    if (cursor != m_cursor && cursor.x >= 0)
+    {
+        put("\x1b["); put(cursor.y + 1); put(";"); put(cursor.x + 1); put("H");
+    }
+
+    m_cursor = cursor;
+    m_fg = fg;
+    m_bg = bg;
+    return m_buffer;
+}
+
+} // namespace z8
+
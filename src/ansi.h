@@ -0,0 +1,74 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include "zepto8.h"
+#include "vm.h"
+#include "encoder.h"
+
+namespace z8
+{
+
+//
+// Encode the VM screen as ANSI escape sequences, two pixels per
+// character cell using the ▀ and ▄ half blocks. Only the cells that
+// changed since the previous frame are sent.
+//
+
+class ansi : public encoder
+{
+public:
+    ansi(lol::ivec2 term_size = lol::ivec2(128, 64));
+
+    virtual char const *name() const { return "ansi"; }
+
+    // Change the terminal size; the next frame is a full redraw
+    virtual void resize(lol::ivec2 term_size);
+
+    // Forget what the terminal contains; the next frame is a full redraw
+    virtual void invalidate() { m_valid = false; }
+    virtual bool is_valid() const { return m_valid; }
+
+    // Encode the differences between the previous frame and the current
+    // VM screen; the returned buffer is reused by the next call.
+    virtual lol::array<uint8_t> const &encode(vm const &vm);
+
+    // Redraw everything sent so far and leave the terminal in the state
+    // the next encode() expects, so that a terminal which missed some
+    // frames can catch up. Uses the same buffer as encode().
+    lol::array<uint8_t> const &keyframe();
+
+private:
+    void put(char const *str);
+    void put(int n);
+    void put_cell(int top, int bottom);
+    void move_to(int x, int y);
+
+    lol::ivec2 m_term_size;
+    bool m_valid;
+
+    // Display colours (0–15) of the cells sent in the previous frame,
+    // with the top pixel in the low nibble.
+    uint8_t m_cells[64][128];
+
+    // Terminal state at the end of the previous frame
+    lol::ivec2 m_cursor;
+    int m_fg, m_bg;
+
+    lol::array<uint8_t> m_buffer;
+};
+
+} // namespace z8
+
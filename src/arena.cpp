@@ -0,0 +1,203 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#if HAVE_SYS_MMAN_H
+#   include <sys/mman.h>
+#endif
+
+#include "arena.h"
+
+namespace z8
+{
+
+// Classes are 16 bytes apart up to 256 bytes, then there are four
+// classes per power of two; Lua grows its arrays by doubling them, so
+// these fit well.
+static int const small_classes = 16;
+static size_t const small_limit = 256;
+static size_t const alignment = 16;
+
+arena::arena(size_t reserve)
+  : m_base(nullptr),
+    m_top(nullptr),
+    m_end(nullptr),
+    m_used(0),
+    m_baseline(0),
+    m_limit(0),
+    m_allocated(0),
+    m_allocations(0)
+{
+    memset(m_free, 0, sizeof(m_free));
+
+#if HAVE_SYS_MMAN_H
+    // Pages are only backed by memory once they are used
+    void *p = mmap(nullptr, reserve, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p != MAP_FAILED)
+    {
+        m_base = m_top = (uint8_t *)p;
+        m_end = m_base + reserve;
+    }
+#else
+    // Without mmap(), everything comes from the C allocator
+    UNUSED(reserve);
+#endif
+}
+
+arena::~arena()
+{
+#if HAVE_SYS_MMAN_H
+    if (m_base)
+        munmap(m_base, m_end - m_base);
+#endif
+}
+
+void arena::install(lua_State *l)
+{
+    // Start counting from what the previous allocator handed out
+    m_used = (size_t)lua_gc(l, LUA_GCCOUNT, 0) * 1024 + lua_gc(l, LUA_GCCOUNTB, 0);
+    lua_setallocf(l, &arena::alloc, this);
+}
+
+void arena::set_limit(size_t bytes)
+{
+    m_baseline = m_used;
+    m_limit = bytes ? m_used + bytes : 0;
+}
+
+int arena::size_class(size_t size, size_t &rounded)
+{
+    if (size <= small_limit)
+    {
+        rounded = (size + alignment - 1) & ~(alignment - 1);
+        return (int)(rounded / alignment);
+    }
+
+    // Size is in (2^k, 2^(k+1)], rounded up to a multiple of 2^(k-2)
+    int k = 8;
+    while (size > (size_t)2 << k)
+        ++k;
+    size_t step = (size_t)1 << (k - 2);
+    rounded = (size + step - 1) & ~(step - 1);
+    return small_classes + 1 + (k - 8) * 4 + (int)(rounded / step) - 5;
+}
+
+bool arena::owns(void const *ptr) const
+{
+    return ptr >= m_base && ptr < m_end;
+}
+
+void *arena::get(size_t size)
+{
+    size_t rounded;
+    int n = size_class(size, rounded);
+    if (n < (int)(sizeof(m_free) / sizeof(*m_free)))
+    {
+        if (m_free[n])
+        {
+            void *ret = m_free[n];
+            m_free[n] = *(void **)ret;
+            return ret;
+        }
+
+        if ((size_t)(m_end - m_top) >= rounded)
+        {
+            void *ret = m_top;
+            m_top += rounded;
+            return ret;
+        }
+    }
+
+    // The region is full, or the block is huge
+    return malloc(size);
+}
+
+void arena::put(void *ptr, size_t size)
+{
+    if (!owns(ptr))
+    {
+        free(ptr);
+        return;
+    }
+
+    size_t rounded;
+    int n = size_class(size, rounded);
+    *(void **)ptr = m_free[n];
+    m_free[n] = ptr;
+}
+
+void *arena::alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    arena *that = (arena *)ud;
+
+    // When ptr is null, osize is a type tag rather than a size
+    if (!ptr)
+        osize = 0;
+
+    if (nsize == 0)
+    {
+        if (ptr)
+        {
+            that->put(ptr, osize);
+            that->m_used -= osize;
+        }
+        return nullptr;
+    }
+
+    // Growing may fail, and Lua then raises an out of memory error
+    if (nsize > osize && that->m_limit && that->m_used + (nsize - osize) > that->m_limit)
+        return nullptr;
+
+    // Nothing to do if the block already has the right size class
+    size_t old_rounded, new_rounded;
+    void *ret = ptr;
+    if (!ptr || !that->owns(ptr)
+         || size_class(osize, old_rounded) != size_class(nsize, new_rounded))
+    {
+        ret = that->get(nsize);
+        if (ret)
+        {
+            if (ptr)
+            {
+                memcpy(ret, ptr, lol::min(osize, nsize));
+                that->put(ptr, osize);
+            }
+            ++that->m_allocations;
+        }
+        else if (nsize < osize)
+        {
+            // Shrinking must not fail, and the old block is big enough
+            ret = ptr;
+        }
+        else
+        {
+            return nullptr;
+        }
+    }
+
+    that->m_used += nsize - osize;
+    if (nsize > osize)
+        that->m_allocated += nsize - osize;
+    return ret;
+}
+
+} // namespace z8
+
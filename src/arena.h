@@ -0,0 +1,78 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include <cstdint>
+
+#include "zepto8.h"
+
+namespace z8
+{
+
+//
+// A lua_Alloc for a single Lua state. Blocks are rounded up to size
+// classes and carved from one memory region reserved up front; freed
+// blocks go to a free list for their class. Nothing is shared with other
+// states, so there is no locking, and the whole region is released at
+// once when the arena is destroyed, which must happen after lua_close().
+//
+// Blocks allocated before the arena was installed, and blocks that did
+// not fit in the region, come from the C allocator and go back to it.
+//
+
+class arena
+{
+public:
+    arena(size_t reserve = 4 << 20);
+    ~arena();
+
+    // Use this arena for all further allocations of a Lua state
+    void install(lua_State *l);
+
+    // Fail allocations that would bring the memory in use more than
+    // this many bytes above the current figure, or 0 for no limit; that
+    // figure becomes the baseline
+    void set_limit(size_t bytes);
+
+    // Bytes in use by Lua, as requested, total bytes ever requested, and
+    // number of allocations
+    size_t used() const { return m_used; }
+    uint64_t allocated() const { return m_allocated; }
+    uint64_t allocations() const { return m_allocations; }
+
+    // Bytes in use above the baseline, which is what the limit applies to
+    size_t used_above_baseline() const
+    {
+        return m_used > m_baseline ? m_used - m_baseline : 0;
+    }
+
+private:
+    static void *alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+    void *get(size_t size);
+    void put(void *ptr, size_t size);
+    bool owns(void const *ptr) const;
+
+    static int size_class(size_t size, size_t &rounded);
+
+    uint8_t *m_base, *m_top, *m_end;
+    void *m_free[80];
+
+    size_t m_used, m_baseline, m_limit;
+    uint64_t m_allocated, m_allocations;
+};
+
+} // namespace z8
+
@@ -0,0 +1,163 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <algorithm>
+
+#include <errno.h>
+
+#include "broadcast.h"
+
+namespace z8
+{
+
+// A spectator with more frames than this waiting is considered lagging
+static int const max_queued_frames = 8;
+
+spectator::spectator()
+  : m_term_size(128, 64),
+    m_need_keyframe(true),
+    m_offset(0)
+{
+    std::shared_ptr<lol::array<uint8_t>> handshake(new lol::array<uint8_t>);
+    telnet_input::handshake(*handshake);
+    m_frames.push_back(handshake);
+}
+
+bool spectator::read(int fd)
+{
+#if HAVE_UNISTD_H
+    int bytes = m_input.read(fd);
+    if (bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        return false;
+#endif
+
+    // Spectators cannot play, but Escape still leaves
+    for (telnet_input::event e; m_input.poll(e); )
+        if (e.key == 0x1b)
+            return false;
+
+    lol::ivec2 term_size;
+    if (m_input.take_resize(term_size) && term_size != m_term_size)
+    {
+        // Moving to another group, whose terminals look different
+        m_term_size = term_size;
+        m_need_keyframe = true;
+    }
+
+    return true;
+}
+
+uint8_t const *spectator::pending() const
+{
+    return m_frames.size() ? m_frames.front()->data() + m_offset : nullptr;
+}
+
+int spectator::pending_size() const
+{
+    return m_frames.size() ? m_frames.front()->count() - m_offset : 0;
+}
+
+void spectator::consume(int size)
+{
+    m_offset += size;
+    if (m_frames.size() && m_offset == m_frames.front()->count())
+    {
+        m_frames.pop_front();
+        m_offset = 0;
+    }
+}
+
+void broadcast::add(spectator *s)
+{
+    m_spectators.push_back(s);
+}
+
+void broadcast::remove(spectator *s)
+{
+    m_spectators.erase(std::remove(m_spectators.begin(), m_spectators.end(), s),
+                       m_spectators.end());
+}
+
+void broadcast::update(vm const &vm, bool dirty)
+{
+    for (auto &it : m_groups)
+        it.second->members.clear();
+
+    for (spectator *s : m_spectators)
+    {
+        auto key = std::make_pair(s->m_term_size.x, s->m_term_size.y);
+        auto &g = m_groups[key];
+        if (!g)
+            g.reset(new group(s->m_term_size));
+        g->members.push_back(s);
+
+        // Drop what a lagging spectator did not receive yet, except for
+        // the frame it is in the middle of, and resync with a keyframe
+        if (s->m_frames.size() > max_queued_frames)
+        {
+            s->m_frames.resize(s->m_offset ? 1 : 0);
+            s->m_need_keyframe = true;
+        }
+    }
+
+    for (auto it = m_groups.begin(); it != m_groups.end(); )
+    {
+        group &g = *it->second;
+
+        // Forget about terminal sizes nobody uses any more
+        if (g.members.empty())
+        {
+            it = m_groups.erase(it);
+            continue;
+        }
+        ++it;
+
+        // The first frame of a group is a full redraw, good for everyone
+        bool full = !g.encoder.is_valid();
+
+        spectator::frame diff;
+        if (dirty || full)
+        {
+            lol::array<uint8_t> const &data = g.encoder.encode(vm);
+            if (data.count())
+                diff = std::make_shared<lol::array<uint8_t> const>(data);
+        }
+
+        // Built at most once per group, however many spectators need it
+        spectator::frame key;
+
+        for (spectator *s : g.members)
+        {
+            if (s->m_need_keyframe && !full)
+            {
+                if (!key)
+                    key = std::make_shared<lol::array<uint8_t> const>(g.encoder.keyframe());
+                s->m_frames.push_back(key);
+            }
+            else if (diff)
+            {
+                s->m_frames.push_back(diff);
+            }
+
+            s->m_need_keyframe = false;
+        }
+    }
+}
+
+} // namespace z8
+
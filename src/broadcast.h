@@ -0,0 +1,90 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "zepto8.h"
+#include "vm.h"
+#include "ansi.h"
+#include "telnet.h"
+
+namespace z8
+{
+
+//
+// A spectator watching a VM over telnet. Frames are shared with every
+// other spectator of the same terminal size and are never copied.
+//
+
+class spectator
+{
+public:
+    spectator();
+
+    // Read what the client sent; returns false if it left or hit Escape
+    bool read(int fd);
+
+    // Bytes waiting to be sent to the client
+    uint8_t const *pending() const;
+    int pending_size() const;
+    void consume(int size);
+
+private:
+    friend class broadcast;
+
+    typedef std::shared_ptr<lol::array<uint8_t> const> frame;
+
+    telnet_input m_input;
+    lol::ivec2 m_term_size;
+    bool m_need_keyframe;
+
+    std::deque<frame> m_frames;
+    int m_offset;
+};
+
+//
+// Encode the frames of one VM once per distinct terminal size, then fan
+// them out to all spectators. A spectator that falls too far behind has
+// its queue dropped and is sent a keyframe instead.
+//
+
+class broadcast
+{
+public:
+    void add(spectator *s);
+    void remove(spectator *s);
+
+    // Encode the current frame and queue it for every spectator
+    void update(vm const &vm, bool dirty);
+
+private:
+    struct group
+    {
+        group(lol::ivec2 term_size) : encoder(term_size) {}
+
+        ansi encoder;
+        std::vector<spectator *> members;
+    };
+
+    std::vector<spectator *> m_spectators;
+    std::map<std::pair<int, int>, std::unique_ptr<group>> m_groups;
+};
+
+} // namespace z8
+
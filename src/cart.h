@@ -47,7 +47,9 @@ public:
         return m_code;
     }
 
-    lol::String const &get_lua()
+    // The code is fixed on first use; call this once before sharing
+    // the cart between threads
+    lol::String const &get_lua() const
     {
         if (m_lua.count() == 0)
             m_lua = code_fixer(m_code).fix();
@@ -64,7 +66,8 @@ private:
 
     lol::array<uint8_t> m_rom;
     lol::array<uint8_t> m_label;
-    lol::String m_code, m_lua;
+    lol::String m_code;
+    mutable lol::String m_lua;
     int m_version;
 };
 
@@ -50,9 +50,11 @@ do
     end
 
     -- All flip() does for now is yield so that the C++ VM gets a chance
-    -- to draw something even if Lua is in an infinite loop
+    -- to draw something even if Lua is in an infinite loop, then start
+    -- a new frame for stat(1)
     flip = function()
         yield()
+        _begin_frame(30)
     end
 
     -- Backward compatibility for old PICO-8 versions
@@ -84,7 +86,9 @@ coroutine = nil
 --
 _z8.run = function(cart_code)
     _z8.loop = cocreate(function()
-        local do_frame = true
+        -- time() counts from here, not from when the VM was built, which
+        -- may be long before for a VM that waited in the zygote
+        _start_clock()
 
         -- First reload cart into memory
         memset(0, 0, 0x8000)
@@ -95,7 +99,8 @@ _z8.run = function(cart_code)
         -- clip() camera() pal() color()”
         --
         -- Note from Sam: this should probably be color(6) instead.
-        clip() camera() pal() color(6)
+        -- The fill pattern is also reset.
+        clip() camera() pal() color(6) fillp()
 
         -- Load cart
         cart_code()
@@ -103,33 +108,45 @@ _z8.run = function(cart_code)
         -- Initialise if available
         if _init ~= nil then _init() end
 
-        -- Execute the user functions
-        while true do
-            if _update60 ~= nil then
-                _update_buttons()
-                _update60()
-            elseif _update ~= nil then
-                if do_frame then
-                    _update_buttons()
-                    _update()
-                end
-                do_frame = not do_frame
-            end
-            if _draw ~= nil and do_frame then
-                _draw()
-            end
-            yield()
-        end
+        _z8.do_frame = true
+        _z8.main_loop()
     end)
 end
 
-_z8.tick = function()
-    if costatus(_z8.loop) == "dead" then
-        return
-    end
-    ret, err = coresume(_z8.loop)
-    if not ret then
-        printh(err)
+-- Resume a cart whose state was restored by vm::restore(): everything
+-- is already in place, so go straight to the main loop
+_z8.resume = function()
+    _z8.loop = cocreate(_z8.main_loop)
+end
+
+-- Execute the user functions. The loop state lives in _z8 rather than
+-- in locals, and at_yield tells whether we are between two frames, so
+-- that vm::save() can capture the loop without its coroutine.
+_z8.main_loop = function()
+    while true do
+        -- Every frame starts here, whatever callbacks the cart defines;
+        -- with _update(), only every other iteration is a frame
+        if _update60 ~= nil or _update == nil then
+            _begin_frame(60)
+        elseif _z8.do_frame then
+            _begin_frame(30)
+        end
+        if _update60 ~= nil then
+            _update_buttons()
+            _update60()
+        elseif _update ~= nil then
+            if _z8.do_frame then
+                _update_buttons()
+                _update()
+            end
+            _z8.do_frame = not _z8.do_frame
+        end
+        if _draw ~= nil and _z8.do_frame then
+            _draw()
+        end
+        _z8.at_yield = true
+        yield()
+        _z8.at_yield = false
     end
 end
 
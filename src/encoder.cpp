@@ -0,0 +1,35 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#include <lol/engine.h>
+
+#include "encoder.h"
+#include "ansi.h"
+#include "sixel.h"
+#include "kitty.h"
+
+namespace z8
+{
+
+encoder *encoder::create(char const *name, lol::ivec2 term_size)
+{
+    if (!strcmp(name, "ansi"))
+        return new ansi(term_size);
+    if (!strcmp(name, "sixel"))
+        return new sixel(term_size);
+    if (!strcmp(name, "kitty"))
+        return new kitty(term_size);
+    return nullptr;
+}
+
+} // namespace z8
+
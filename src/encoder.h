@@ -0,0 +1,58 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include "zepto8.h"
+#include "vm.h"
+
+namespace z8
+{
+
+//
+// Turn the VM screen into a byte stream for a terminal. Encoders keep
+// track of what the terminal shows, so that each frame only carries
+// what changed since the previous one.
+//
+
+class encoder
+{
+public:
+    virtual ~encoder() {}
+
+    // Short name, e.g. for the command line
+    virtual char const *name() const = 0;
+
+    // Change the terminal size; the next frame is a full redraw
+    virtual void resize(lol::ivec2 term_size) = 0;
+
+    // Forget what the terminal contains; the next frame is a full redraw
+    virtual void invalidate() = 0;
+    virtual bool is_valid() const = 0;
+
+    // Encode the current VM screen; the returned buffer is reused by
+    // the next call and is empty if there is nothing to send.
+    virtual lol::array<uint8_t> const &encode(vm const &vm) = 0;
+
+    // Escape sequences giving the terminal back in its usual state once
+    // we are done: default colours, and the cursor visible again
+    virtual char const *teardown() const { return "\x1b[0m\x1b[?25h"; }
+
+    // Create an encoder by name (“ansi”, “sixel” or “kitty”), or return
+    // nullptr if there is no such encoder
+    static encoder *create(char const *name, lol::ivec2 term_size);
+};
+
+} // namespace z8
+
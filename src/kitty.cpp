@@ -0,0 +1,159 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#include <lol/engine.h>
+
+#include "kitty.h"
+
+namespace z8
+{
+
+static char const base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Pixels per escape sequence: 3 bytes of RGB are 4 base64 characters,
+// and the protocol wants chunks of at most 4096 characters
+static int const chunk_pixels = 1024;
+
+kitty::kitty(lol::ivec2 term_size)
+  : m_term_size(term_size),
+    m_valid(false)
+{
+}
+
+void kitty::resize(lol::ivec2 term_size)
+{
+    m_term_size = term_size;
+    m_valid = false;
+}
+
+void kitty::put(char const *str)
+{
+    while (*str)
+        m_buffer << (uint8_t)*str++;
+}
+
+void kitty::put(int n)
+{
+    if (n >= 10)
+        put(n / 10);
+    m_buffer << (uint8_t)('0' + n % 10);
+}
+
+// Send a w×h rectangle of the screen at (x,y) as RGB data, split in as
+// many escape sequences as needed: either as a new image covering the
+// given number of terminal rows, or as a patch to the existing image
+void kitty::put_image(int rows, uint8_t const *pixels, int x, int y, int w, int h)
+{
+    lol::u8vec4 colors[16];
+    for (int i = 0; i < 16; ++i)
+        colors[i] = palette::get(i);
+
+    int total = w * h;
+    for (int start = 0; start < total; start += chunk_pixels)
+    {
+        put("\x1b_G");
+        if (start == 0)
+        {
+            if (rows)
+            {
+                put("a=T,i=1,C=1,c="); put(2 * rows);
+                put(",r="); put(rows);
+            }
+            else
+            {
+                put("a=f,i=1,r=1,x="); put(x);
+                put(",y="); put(y);
+            }
+            put(",f=24,s="); put(w);
+            put(",v="); put(h);
+            put(",q=2,");
+        }
+        put(start + chunk_pixels < total ? "m=1;" : "m=0;");
+
+        int end = lol::min(total, start + chunk_pixels);
+        for (int n = start; n < end; ++n)
+        {
+            lol::u8vec4 c = colors[pixels[(y + n / w) * 128 + x + n % w]];
+            m_buffer << (uint8_t)base64[c.r >> 2]
+                     << (uint8_t)base64[((c.r & 0x3) << 4) | (c.g >> 4)]
+                     << (uint8_t)base64[((c.g & 0xf) << 2) | (c.b >> 6)]
+                     << (uint8_t)base64[c.b & 0x3f];
+        }
+
+        put("\x1b\\");
+    }
+}
+
+lol::array<uint8_t> const &kitty::encode(vm const &vm)
+{
+    m_buffer.empty();
+
+    uint8_t pixels[128 * 128];
+    vm.render(pixels, 128, vm::pixel_format::indexed);
+
+    if (!m_valid)
+    {
+        // Terminal cells are usually twice as high as wide
+        int rows = lol::max(1, lol::min(m_term_size.y, m_term_size.x / 2));
+
+        put("\x1b[0m\x1b[2J\x1b[?25l\x1b[H");
+        put("\x1b_Ga=d,d=I,i=1,q=2\x1b\\");
+        put_image(rows, pixels, 0, 0, 128, 128);
+
+        memcpy(m_pixels, pixels, sizeof(pixels));
+        m_valid = true;
+        return m_buffer;
+    }
+
+    // Patch the bounding box of each group of changed rows; close groups
+    // are merged since each patch costs about 50 bytes of overhead
+    for (int y = 0; y < 128; )
+    {
+        if (!memcmp(pixels + y * 128, m_pixels + y * 128, 128))
+        {
+            ++y;
+            continue;
+        }
+
+        int y0 = y, y1 = y, x0 = 128, x1 = -1;
+        for (int gap = 0; y < 128 && gap < 2; ++y)
+        {
+            uint8_t const *a = pixels + y * 128, *b = m_pixels + y * 128;
+            if (!memcmp(a, b, 128))
+            {
+                ++gap;
+                continue;
+            }
+
+            gap = 0;
+            y1 = y;
+            int left = 0, right = 127;
+            while (a[left] == b[left])
+                ++left;
+            while (a[right] == b[right])
+                --right;
+            x0 = lol::min(x0, left);
+            x1 = lol::max(x1, right);
+        }
+
+        put_image(0, pixels, x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+
+        for (int j = y0; j <= y1; ++j)
+            memcpy(m_pixels + j * 128 + x0, pixels + j * 128 + x0, x1 - x0 + 1);
+    }
+
+    return m_buffer;
+}
+
+} // namespace z8
+
@@ -0,0 +1,59 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include "zepto8.h"
+#include "vm.h"
+#include "encoder.h"
+
+namespace z8
+{
+
+//
+// Encode the VM screen using the kitty terminal graphics protocol. The
+// whole screen is sent once as an RGB image scaled to the terminal;
+// after that, only the rectangles around changed rows are sent, and
+// patched into the displayed image in place.
+//
+
+class kitty : public encoder
+{
+public:
+    kitty(lol::ivec2 term_size = lol::ivec2(128, 64));
+
+    virtual char const *name() const { return "kitty"; }
+
+    virtual void resize(lol::ivec2 term_size);
+    virtual void invalidate() { m_valid = false; }
+    virtual bool is_valid() const { return m_valid; }
+
+    virtual lol::array<uint8_t> const &encode(vm const &vm);
+
+private:
+    void put(char const *str);
+    void put(int n);
+    void put_image(int rows, uint8_t const *pixels, int x, int y, int w, int h);
+
+    lol::ivec2 m_term_size;
+    bool m_valid;
+
+    // Display colours of the image shown by the terminal
+    uint8_t m_pixels[128 * 128];
+
+    lol::array<uint8_t> m_buffer;
+};
+
+} // namespace z8
+
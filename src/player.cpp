@@ -128,10 +128,16 @@ void player::TickDraw(float seconds, lol::Scene &scene)
 
     lol::Renderer::Get()->SetClearColor(lol::Color::black);
 
-    m_vm.render(m_screen.data());
+    // Only upload the screen texture if something changed
+    uint64_t dirty[2];
+    m_vm.take_dirty(dirty);
+    if (dirty[0] | dirty[1])
+    {
+        m_vm.render(m_screen.data());
 
-    m_tile->GetTexture()->Bind();
-    m_tile->GetTexture()->SetData(m_screen.data());
+        m_tile->GetTexture()->Bind();
+        m_tile->GetTexture()->SetData(m_screen.data());
+    }
 
     int delta_x = (WINDOW_WIDTH - 512) / 2;
     int delta_y = (WINDOW_HEIGHT - 512) / 2;
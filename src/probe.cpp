@@ -0,0 +1,270 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <chrono>
+
+#if HAVE_SYS_EPOLL_H
+#   include <poll.h>
+#   include <sys/socket.h>
+#   include <netinet/in.h>
+#   include <errno.h>
+#   include <unistd.h>
+#endif
+
+#include "probe.h"
+
+namespace z8
+{
+
+// How long each client plays before pressing Escape
+static double const play_time = 0.5;
+
+static double clock()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+probe::probe(int port, int clients)
+  : m_port(port),
+    m_clients(lol::max(clients, 1))
+{
+}
+
+#if HAVE_SYS_EPOLL_H
+
+probe::~probe()
+{
+    for (auto &c : m_clients)
+        if (c.fd >= 0)
+            ::close(c.fd);
+}
+
+bool probe::connect(client &c)
+{
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c.fd < 0)
+        return false;
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)m_port);
+
+    if (::connect(c.fd, (sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+    {
+        ::close(c.fd);
+        c.fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void probe::send(client &c, char const *data, int size)
+{
+    if (::send(c.fd, data, size, MSG_NOSIGNAL) != size)
+        fail(c, "cannot send");
+}
+
+void probe::fail(client &c, char const *error)
+{
+    c.error = error;
+    c.st = state::failed;
+    if (c.fd >= 0)
+        ::close(c.fd);
+    c.fd = -1;
+}
+
+void probe::receive(client &c, double now)
+{
+    for (;;)
+    {
+        char buf[4096];
+        ssize_t bytes = recv(c.fd, buf, sizeof(buf), 0);
+        if (bytes < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fail(c, "connection error");
+            return;
+        }
+
+        if (bytes == 0)
+        {
+            // The server hung up, which is only fine once we quit and
+            // got the terminal back
+            if (c.st != state::quitting)
+                fail(c, "disconnected early");
+            else if (!c.restored)
+                fail(c, "terminal not restored");
+            else
+            {
+                ::close(c.fd);
+                c.fd = -1;
+                c.st = state::done;
+            }
+            return;
+        }
+
+        c.tail.append(buf, bytes);
+
+        // The window size triggers a full redraw, which clears the screen
+        if (c.st == state::negotiating && c.tail.find("\x1b[2J") != std::string::npos)
+        {
+            c.st = state::playing;
+            c.time = now;
+            send(c, "zx\x1b[A", 5); // O, X and up
+        }
+
+        if (c.st == state::quitting && c.tail.find("\x1b[?25h") != std::string::npos)
+            c.restored = true;
+
+        // Keep enough for a sequence split across two reads
+        if (c.tail.size() > 8)
+            c.tail.erase(0, c.tail.size() - 8);
+    }
+}
+
+bool probe::run(double timeout)
+{
+    // IAC WILL NAWS, IAC SB NAWS 80×24 IAC SE, IAC DONT MCCP2
+    static char const hello[] = "\xff\xfb\x1f" "\xff\xfa\x1f\x00\x50\x00\x18\xff\xf0"
+                                "\xff\xfe\x56";
+
+    double start = clock();
+    for (auto &c : m_clients)
+        connect(c);
+
+    for (;;)
+    {
+        double now = clock();
+
+        std::vector<pollfd> fds;
+        std::vector<int> index;
+        int waiting = 0;
+        for (int i = 0; i < (int)m_clients.size(); ++i)
+        {
+            client &c = m_clients[i];
+            if (c.st == state::done || c.st == state::failed)
+                continue;
+
+            if (now - start > timeout)
+            {
+                fail(c, c.st == state::connecting ? "cannot connect"
+                      : c.st == state::negotiating ? "no frame received"
+                      : "no disconnection");
+                continue;
+            }
+
+            // The server may still be starting: try again shortly
+            if (c.fd < 0)
+            {
+                if (now - c.time < 0.1)
+                {
+                    ++waiting;
+                    continue;
+                }
+                c.time = now;
+                if (!connect(c))
+                {
+                    ++waiting;
+                    continue;
+                }
+            }
+
+            if (c.st == state::playing && now - c.time > play_time)
+            {
+                c.st = state::quitting;
+                c.time = now;
+                send(c, "\x1b\x1b", 2); // Escape
+                if (c.st == state::failed)
+                    continue;
+            }
+
+            short events = POLLIN;
+            if (c.st == state::connecting)
+                events |= POLLOUT;
+            fds.push_back(pollfd { c.fd, events, 0 });
+            index.push_back(i);
+        }
+
+        if (fds.empty() && !waiting)
+            break;
+
+        if (poll(fds.data(), fds.size(), 20) < 0 && errno != EINTR)
+            break;
+
+        now = clock();
+        for (size_t n = 0; n < fds.size(); ++n)
+        {
+            client &c = m_clients[index[n]];
+            if (!fds[n].revents || c.fd < 0)
+                continue;
+
+            if (c.st == state::connecting)
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err)
+                {
+                    ::close(c.fd);
+                    c.fd = -1;
+                    c.time = now;
+                    continue;
+                }
+
+                c.st = state::negotiating;
+                c.time = now;
+                send(c, hello, sizeof(hello) - 1);
+                if (c.st == state::failed)
+                    continue;
+            }
+
+            if (fds[n].revents & (POLLIN | POLLHUP | POLLERR))
+                receive(c, now);
+        }
+    }
+
+    int passed = 0;
+    for (int i = 0; i < (int)m_clients.size(); ++i)
+    {
+        client const &c = m_clients[i];
+        if (c.st == state::done)
+            ++passed;
+        else
+            lol::msg::error("client %d: %s\n", i, c.error ? c.error : "unfinished");
+    }
+
+    lol::msg::info("%d of %d clients passed\n", passed, (int)m_clients.size());
+    return passed == (int)m_clients.size();
+}
+
+#else
+
+probe::~probe() {}
+bool probe::connect(client &) { return false; }
+void probe::send(client &, char const *, int) {}
+void probe::receive(client &, double) {}
+void probe::fail(client &, char const *) {}
+bool probe::run(double) { return false; }
+
+#endif
+
+} // namespace z8
+
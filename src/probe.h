@@ -0,0 +1,72 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include <string>
+#include <vector>
+
+#include "zepto8.h"
+
+namespace z8
+{
+
+//
+// Scripted telnet clients for testing the server over loopback. Each
+// client connects, refuses compression, sends its window size, waits
+// for the first full frame, presses a few keys, then quits with Escape
+// and expects the terminal to be restored before the server hangs up.
+//
+
+class probe
+{
+public:
+    probe(int port, int clients);
+    ~probe();
+
+    // Run all clients to completion; returns whether they all passed
+    bool run(double timeout = 10.0);
+
+private:
+    enum class state
+    {
+        connecting,
+        negotiating,
+        playing,
+        quitting,
+        done,
+        failed,
+    };
+
+    struct client
+    {
+        int fd = -1;
+        state st = state::connecting;
+        double time = 0.0; // when the current state started
+        bool restored = false;
+        std::string tail;  // last bytes received, for matching
+        char const *error = nullptr;
+    };
+
+    bool connect(client &c);
+    void send(client &c, char const *data, int size);
+    void receive(client &c, double now);
+    void fail(client &c, char const *error);
+
+    int m_port;
+    std::vector<client> m_clients;
+};
+
+} // namespace z8
+
@@ -0,0 +1,238 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#include <lol/engine.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "scheduler.h"
+#include "vm.h"
+
+namespace z8
+{
+
+//
+// Worker pool
+//
+
+worker_pool::worker_pool(int threads)
+{
+    if (threads <= 0)
+        threads = (int)std::thread::hardware_concurrency();
+
+    // The calling thread is one of the workers
+    for (int i = 1; i < threads; ++i)
+        m_threads.push_back(std::thread(&worker_pool::work, this));
+}
+
+worker_pool::~worker_pool()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_start.notify_all();
+
+    for (auto &t : m_threads)
+        t.join();
+}
+
+void worker_pool::run(int count, std::function<void(int)> const &job)
+{
+    if (count <= 0)
+        return;
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_job = &job;
+        m_count = count;
+        m_next = 0;
+        m_pending = count;
+        ++m_generation;
+    }
+    m_start.notify_all();
+
+    drain();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]() { return m_pending == 0; });
+    m_job = nullptr;
+}
+
+void worker_pool::work()
+{
+    int generation = 0;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_start.wait(lock, [&]() { return m_quit || m_generation != generation; });
+            if (m_quit)
+                return;
+            generation = m_generation;
+        }
+
+        drain();
+    }
+}
+
+// Process indices until there are none left in the current batch
+void worker_pool::drain()
+{
+    for (;;)
+    {
+        std::function<void(int)> const *job;
+        int index;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (!m_job || m_next >= m_count)
+                return;
+            job = m_job;
+            index = m_next++;
+        }
+
+        (*job)(index);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (--m_pending == 0)
+            m_done.notify_all();
+    }
+}
+
+//
+// Scheduler
+//
+
+// Demotion levels; a VM at the last level runs once every 8 periods
+static int const max_level = 3;
+
+// A VM is demoted after exhausting its budget in this many more frames
+// than not, and promoted back after this many frames in a row within it
+static int const demote_strikes = 30;
+static int const promote_frames = 300;
+
+// Time budget bounds: below this, light carts would be interrupted for
+// no reason, and a single VM must leave time for the others
+static double const min_slice = 0.001;
+
+static double clock()
+{
+    return std::chrono::duration<double>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+scheduler::scheduler(double period, int threads)
+  : m_period(period),
+    m_pool(threads),
+    m_ticks(0)
+{
+}
+
+void scheduler::run(std::vector<uint64_t> const &ids,
+                    std::function<bool(int, int, double)> const &step)
+{
+    double now = clock();
+    ++m_ticks;
+
+    // Some of the tick is left for network I/O
+    double end = now + m_period * 0.75;
+
+    // Find the VMs due during this tick, and forget the ones that left
+    std::vector<int> due;
+    std::vector<entry *> entries;
+    for (int i = 0; i < (int)ids.size(); ++i)
+    {
+        auto it = m_entries.find(ids[i]);
+        if (it == m_entries.end())
+            it = m_entries.emplace(ids[i], entry{ now, 0, 0, 0, 0 }).first;
+        it->second.seen = m_ticks;
+        if (it->second.deadline < now + m_period * 0.5)
+            due.push_back(i);
+    }
+
+    for (auto it = m_entries.begin(); it != m_entries.end(); )
+        it = it->second.seen == m_ticks ? std::next(it) : m_entries.erase(it);
+
+    std::sort(due.begin(), due.end(), [&](int a, int b)
+    {
+        entry const &ea = m_entries[ids[a]], &eb = m_entries[ids[b]];
+        return ea.deadline != eb.deadline ? ea.deadline < eb.deadline
+             : ea.level != eb.level ? ea.level < eb.level
+             : ids[a] < ids[b];
+    });
+    for (int i : due)
+        entries.push_back(&m_entries[ids[i]]);
+
+    // Each VM gets its fair share of the tick
+    int count = (int)due.size();
+    double share = lol::clamp(m_period * m_pool.size() / lol::max(count, 1),
+                              min_slice, m_period * 0.5);
+
+    std::vector<char> ran(count), exhausted(count);
+    m_pool.run(count, [&](int n)
+    {
+        if (clock() >= end)
+            return;
+        ran[n] = true;
+        exhausted[n] = step(due[n], vm::default_budget, share);
+    });
+
+    for (int n = 0; n < count; ++n)
+    {
+        entry &e = *entries[n];
+        m_report.max_late = lol::max(m_report.max_late, now - e.deadline);
+
+        if (!ran[n])
+        {
+            ++m_report.starved;
+            continue;
+        }
+
+        if (exhausted[n])
+        {
+            e.clean = 0;
+            if (++e.strikes >= demote_strikes && e.level < max_level)
+            {
+                ++e.level;
+                e.strikes = 0;
+            }
+        }
+        else
+        {
+            e.strikes = lol::max(e.strikes - 1, 0);
+            if (++e.clean >= promote_frames && e.level > 0)
+            {
+                --e.level;
+                e.clean = 0;
+            }
+        }
+
+        // VMs that fell behind do not try to catch up
+        if (now - e.deadline > m_period * 0.5)
+            e.deadline = now;
+        e.deadline += m_period * (1 << e.level);
+    }
+}
+
+scheduler::report scheduler::take_report()
+{
+    report ret = m_report;
+    for (auto const &it : m_entries)
+        ret.demoted += it.second.level > 0;
+    m_report = report();
+    return ret;
+}
+
+} // namespace z8
+
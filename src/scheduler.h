@@ -0,0 +1,109 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "zepto8.h"
+
+namespace z8
+{
+
+//
+// A fixed set of threads running the same job over a range of indices.
+// The calling thread takes part in the work and run() only returns once
+// every index was processed.
+//
+
+class worker_pool
+{
+public:
+    worker_pool(int threads = 0);
+    ~worker_pool();
+
+    void run(int count, std::function<void(int)> const &job);
+
+    // Number of threads, including the calling thread
+    int size() const { return (int)m_threads.size() + 1; }
+
+private:
+    void work();
+    void drain();
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_start, m_done;
+
+    std::function<void(int)> const *m_job = nullptr;
+    int m_count = 0, m_next = 0, m_pending = 0;
+    int m_generation = 0;
+    bool m_quit = false;
+};
+
+//
+// Share the CPU between many VMs ticking at the same rate. At each tick,
+// the VMs that are due run on the worker pool in deadline order, each
+// with a budget of emulated CPU cycles and of time. VMs that keep exhausting
+// their budget are demoted and run less often until they behave again;
+// VMs that did not get to run before the end of the tick are starved,
+// keep their deadline, and thus run first at the next tick.
+//
+
+class scheduler
+{
+public:
+    scheduler(double period, int threads = 0);
+
+    // Run one tick over the VMs with the given ids; “step” is called for
+    // each VM allowed to run, with its index in “ids” and its budget, and
+    // returns whether the VM exhausted that budget.
+    void run(std::vector<uint64_t> const &ids,
+             std::function<bool(int index, int cycles, double seconds)> const &step);
+
+    struct report
+    {
+        int demoted = 0;       // VMs currently demoted
+        int64_t starved = 0;   // frames not run for lack of time
+        double max_late = 0.0; // worst delay of a frame, in seconds
+    };
+
+    // Statistics since the last call
+    report take_report();
+
+private:
+    struct entry
+    {
+        double deadline;
+        int level;   // demotion level: runs every 2^level periods
+        int strikes; // recent frames that exhausted their budget
+        int clean;   // frames in a row within budget
+        int seen;
+    };
+
+    double m_period;
+    worker_pool m_pool;
+    std::unordered_map<uint64_t, entry> m_entries;
+    int m_ticks;
+    report m_report;
+};
+
+} // namespace z8
+
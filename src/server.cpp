@@ -0,0 +1,499 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <chrono>
+#include <string>
+
+#if HAVE_SYS_EPOLL_H
+#   include <sys/epoll.h>
+#   include <sys/socket.h>
+#   include <netinet/in.h>
+#   include <fcntl.h>
+#   include <errno.h>
+#   include <unistd.h>
+#endif
+
+#include "server.h"
+
+namespace z8
+{
+
+//
+// Telnet server
+//
+
+// Disconnect clients that let more than this amount of output pile up
+static int const max_pending = 1 << 20;
+
+server::server(char const *cart, int port, int watch_port, int compression,
+               char const *encoder, int offload)
+  : m_cart(cart),
+    m_encoder(encoder),
+    m_port(port),
+    m_watch_port(watch_port),
+    m_compression(compression),
+    m_offload(offload),
+    m_listen_fd(-1),
+    m_watch_fd(-1),
+    m_epoll_fd(-1),
+    m_serial(0),
+    m_featured(0),
+    m_ticks(0),
+    m_scheduler(1.0 / 60.0),
+    m_zygote(cart)
+{
+}
+
+void server::count(int &active, int &idle, int &suspended, int &offloaded,
+                   int &unsaveable) const
+{
+    active = idle = suspended = offloaded = unsaveable = 0;
+    for (auto const &it : m_connections)
+    {
+        if (!it.second->session)
+            continue;
+        switch (it.second->session->get_activity())
+        {
+            case telnet::activity::starting:
+            case telnet::activity::active: ++active; break;
+            case telnet::activity::throttled: ++idle; break;
+            case telnet::activity::suspended:
+                ++idle; ++suspended;
+                unsaveable += it.second->session->unsaveable() != nullptr;
+                break;
+            case telnet::activity::offloaded: ++idle; ++suspended; ++offloaded; break;
+        }
+    }
+}
+
+uint8_t const *server::connection::pending() const
+{
+    return session ? session->pending() : watcher->pending();
+}
+
+int server::connection::pending_size() const
+{
+    return session ? session->pending_size() : watcher->pending_size();
+}
+
+void server::connection::consume(int size)
+{
+    if (session)
+        session->consume(size);
+    else
+        watcher->consume(size);
+}
+
+server::~server()
+{
+#if HAVE_SYS_EPOLL_H
+    while (m_connections.size())
+        close(m_connections.begin()->first);
+    if (m_listen_fd >= 0)
+        ::close(m_listen_fd);
+    if (m_watch_fd >= 0)
+        ::close(m_watch_fd);
+    if (m_epoll_fd >= 0)
+        ::close(m_epoll_fd);
+    if (m_spool.count())
+        rmdir(m_spool.C());
+#endif
+}
+
+void server::run()
+{
+#if HAVE_SYS_EPOLL_H
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd < 0)
+    {
+        lol::msg::error("cannot create epoll instance: %s\n", strerror(errno));
+        return;
+    }
+
+    m_listen_fd = listen(m_port);
+    if (m_listen_fd < 0)
+        return;
+    lol::msg::info("listening on port %d\n", m_port);
+
+    // Offloaded sessions are saved to one file each in a private spool
+    // directory, which is only open while saving or restoring
+    if (m_offload > 0)
+    {
+        char const *tmp = getenv("TMPDIR");
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/zepto8-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+        if (mkdtemp(path))
+        {
+            m_spool = path;
+            lol::msg::info("offloading idle sessions to %s\n", m_spool.C());
+        }
+        else
+        {
+            lol::msg::error("cannot create spool directory: %s\n", strerror(errno));
+            m_offload = 0;
+        }
+    }
+
+    if (m_watch_port > 0)
+    {
+        m_watch_fd = listen(m_watch_port);
+        if (m_watch_fd < 0)
+            return;
+        lol::msg::info("spectators welcome on port %d\n", m_watch_port);
+    }
+
+    using clock = std::chrono::steady_clock;
+    auto const period = std::chrono::microseconds(1000000 / 60);
+    auto next_tick = clock::now();
+
+    for (;;)
+    {
+        auto now = clock::now();
+        int timeout = 0;
+        if (next_tick > now)
+            timeout = (int)std::chrono::duration_cast<std::chrono::milliseconds>(next_tick - now).count();
+
+        epoll_event events[64];
+        int count = epoll_wait(m_epoll_fd, events, 64, timeout);
+        if (count < 0 && errno != EINTR)
+        {
+            lol::msg::error("epoll_wait failed: %s\n", strerror(errno));
+            return;
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == m_listen_fd || fd == m_watch_fd)
+            {
+                accept(fd);
+                continue;
+            }
+
+            auto it = m_connections.find(fd);
+            if (it == m_connections.end())
+                continue;
+
+            connection &c = *it->second;
+            bool alive = !(events[i].events & (EPOLLERR | EPOLLHUP));
+            if (alive && (events[i].events & EPOLLIN))
+                alive = receive(c);
+            if (alive && (events[i].events & EPOLLOUT))
+                alive = flush(c);
+            if (!alive)
+                close(fd);
+        }
+
+        now = clock::now();
+        if (now >= next_tick)
+        {
+            tick();
+
+            // Do not try to catch up if we fell behind by more than a frame
+            next_tick += period;
+            if (next_tick < now)
+                next_tick = now + period;
+        }
+    }
+#endif
+}
+
+#if HAVE_SYS_EPOLL_H
+
+int server::listen(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        lol::msg::error("cannot create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t)port);
+
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0
+         || ::listen(fd, SOMAXCONN) < 0)
+    {
+        lol::msg::error("cannot listen on port %d: %s\n", port, strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+    return fd;
+}
+
+void server::accept(int listen_fd)
+{
+    for (;;)
+    {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                lol::msg::error("accept failed: %s\n", strerror(errno));
+            return;
+        }
+
+        std::unique_ptr<connection> c(new connection);
+        c->fd = fd;
+        c->serial = ++m_serial;
+        if (listen_fd == m_watch_fd)
+        {
+            c->watcher.reset(new spectator());
+            m_broadcast.add(c->watcher.get());
+        }
+        else
+        {
+            c->session.reset(new telnet());
+            c->session->set_compression(m_compression);
+            c->session->set_encoder(m_encoder.C());
+            if (m_offload > 0)
+                c->session->set_offload(m_offload, lol::String::format("%s/%llu.z8s",
+                                        m_spool.C(), (unsigned long long)c->serial).C());
+            c->session->set_zygote(&m_zygote);
+            c->session->load(m_cart.C());
+        }
+        c->closing = false;
+        c->want_write = false;
+
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = fd;
+        m_connections[fd] = std::move(c);
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            close(fd);
+            continue;
+        }
+
+        lol::msg::info("client %d connected (%d connections)\n",
+                       fd, (int)m_connections.size());
+    }
+}
+
+// Read what the client sent; returns false if the client went away.
+// Whatever does not fit in one read() will trigger another event.
+bool server::receive(connection &c)
+{
+    if (c.watcher)
+        return c.watcher->read(c.fd);
+
+    int bytes = c.session->read(c.fd);
+    return bytes > 0 || (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+                                        || errno == EINTR));
+}
+
+// Send as much pending output as the socket accepts; returns false if
+// the client went away
+bool server::flush(connection &c)
+{
+    while (c.pending_size())
+    {
+        ssize_t bytes = send(c.fd, c.pending(), c.pending_size(), MSG_NOSIGNAL);
+        if (bytes > 0)
+        {
+            c.consume((int)bytes);
+            continue;
+        }
+
+        if (bytes < 0 && errno == EINTR)
+            continue;
+
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        return false;
+    }
+
+    // Only ask for EPOLLOUT while there is something left to send
+    bool want_write = c.pending_size() > 0;
+    if (want_write != c.want_write)
+    {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? (uint32_t)EPOLLOUT : 0);
+        ev.data.fd = c.fd;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+        c.want_write = want_write;
+    }
+
+    return c.pending_size() < max_pending;
+}
+
+void server::close(int fd)
+{
+    auto it = m_connections.find(fd);
+    if (it != m_connections.end() && it->second->watcher)
+        m_broadcast.remove(it->second->watcher.get());
+    if (it != m_connections.end() && it->second->session)
+    {
+        telnet::stats const &st = it->second->session->get_stats();
+        lol::msg::info("client %d: %lld frames sent, %lld skipped, %lld bytes, %.1f fps\n",
+                       fd, (long long)st.frames_sent, (long long)st.frames_skipped,
+                       (long long)st.bytes_sent, st.fps);
+        if (st.frames_sent)
+            lol::msg::info("client %d: %s encoder, %lld bytes per frame\n",
+                           fd, it->second->session->encoder_name(),
+                           (long long)(st.bytes_raw / st.frames_sent));
+        if (st.frames_stepped)
+            lol::msg::info("client %d: %lld steps, %.3f ms of garbage collection per step\n",
+                           fd, (long long)st.frames_stepped,
+                           1000.0 * st.gc_seconds / st.frames_stepped);
+        if (st.bytes_compressed < st.bytes_raw)
+            lol::msg::info("client %d: compressed %lld bytes to %lld (%.1f%% saved)\n",
+                           fd, (long long)st.bytes_raw, (long long)st.bytes_compressed,
+                           100.0 * (st.bytes_raw - st.bytes_compressed) / st.bytes_raw);
+    }
+
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+    m_connections.erase(fd);
+    lol::msg::info("client %d disconnected (%d connections)\n",
+                   fd, (int)m_connections.size());
+}
+
+void server::tick()
+{
+    std::vector<connection *> list;
+    for (auto &it : m_connections)
+        if (it.second->session && !it.second->closing)
+            list.push_back(it.second.get());
+
+    // Clients that did not keep up only get some of the frames
+    std::vector<char> send(list.size());
+    for (size_t i = 0; i < list.size(); ++i)
+        send[i] = telnet::can_send(list[i]->fd, list[i]->pending_size());
+
+    // Sessions share nothing, so they can be stepped concurrently; the
+    // scheduler picks which ones run and with how much CPU
+    std::vector<uint64_t> ids(list.size());
+    for (size_t i = 0; i < list.size(); ++i)
+        ids[i] = list[i]->serial;
+
+    m_scheduler.run(ids, [&](int i, int cycles, double seconds)
+    {
+        telnet &session = *list[i]->session;
+        session.set_budget(cycles, seconds);
+        if (!session.step(send[i] != 0))
+            list[i]->closing = true;
+        return session.exhausted();
+    });
+
+    // Spectators watch the oldest session still running and in memory
+    connection *featured = nullptr;
+    for (connection *c : list)
+        if (!c->closing && c->session->has_vm()
+             && (!featured || c->serial < featured->serial))
+            featured = c;
+
+    if (featured)
+    {
+        bool changed = featured->serial != m_featured;
+        m_featured = featured->serial;
+        m_broadcast.update(featured->session->get_vm(),
+                           changed || featured->session->dirty());
+    }
+
+    std::vector<int> dead;
+    for (auto &it : m_connections)
+    {
+        connection &c = *it.second;
+        if (!flush(c) || (c.closing && !c.pending_size()))
+            dead.push_back(c.fd);
+    }
+
+    for (int fd : dead)
+        close(fd);
+
+    // Report session activity once a minute
+    if (++m_ticks % (60 * 60) == 0 && m_connections.size())
+    {
+        int active, idle, suspended, offloaded, unsaveable;
+        count(active, idle, suspended, offloaded, unsaveable);
+        lol::msg::info("%d active sessions, %d idle (%d suspended, %d on disk), %d spectators\n",
+                       active, idle, suspended, offloaded,
+                       (int)m_connections.size() - active - idle);
+
+        // Suspended sessions that stay in memory, and why
+        if (unsaveable)
+        {
+            std::map<std::string, int> reasons;
+            for (auto const &it : m_connections)
+                if (it.second->session && it.second->session->unsaveable())
+                    ++reasons[it.second->session->unsaveable()];
+            lol::String list;
+            for (auto const &r : reasons)
+                list += lol::String::format("%s%d %s", list.count() ? ", " : "",
+                                            r.second, r.first.c_str());
+            lol::msg::info("%d suspended sessions cannot be offloaded (%s)\n",
+                           unsaveable, list.C());
+        }
+
+        // Memory per session in memory, the figure hosts are sized by
+        size_t total = 0, lua = 0;
+        int in_memory = 0;
+        for (auto const &it : m_connections)
+        {
+            telnet const *session = it.second->session.get();
+            if (!session || !session->has_vm())
+                continue;
+            vm::memory_stats m = session->get_vm().memory_usage();
+            total += m.total;
+            lua += m.lua;
+            ++in_memory;
+        }
+        if (in_memory)
+            lol::msg::info("%d KiB per session, of which %d KiB of Lua heap\n",
+                           (int)(total / in_memory / 1024), (int)(lua / in_memory / 1024));
+
+        scheduler::report r = m_scheduler.take_report();
+        if (r.demoted || r.starved)
+            lol::msg::info("%d sessions demoted, %lld frames starved, up to %.0f ms late\n",
+                           r.demoted, (long long)r.starved, r.max_late * 1000.0);
+    }
+}
+
+#else
+
+int server::listen(int) { return -1; }
+void server::accept(int) {}
+bool server::receive(connection &) { return false; }
+bool server::flush(connection &) { return false; }
+void server::close(int) {}
+void server::tick() {}
+
+#endif
+
+} // namespace z8
+
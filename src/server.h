@@ -0,0 +1,89 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "zepto8.h"
+#include "telnet.h"
+#include "broadcast.h"
+#include "scheduler.h"
+#include "zygote.h"
+
+namespace z8
+{
+
+//
+// Serve one cart to many telnet clients at once. Every connection gets
+// its own VM; sockets are non-blocking and multiplexed with epoll, and
+// all sessions are stepped at 60 Hz on a worker pool. Spectators may
+// connect to a second port to watch the oldest running session.
+//
+
+class server
+{
+public:
+    server(char const *cart, int port, int watch_port = 0, int compression = 6,
+           char const *encoder = "auto", int offload = 0);
+    ~server();
+
+    void run();
+
+    // Sessions by activity, for capacity planning; suspended sessions
+    // are idle, and offloaded ones are suspended. Unsaveable sessions are
+    // suspended ones that cannot be offloaded, see telnet::unsaveable().
+    void count(int &active, int &idle, int &suspended, int &offloaded,
+               int &unsaveable) const;
+
+private:
+    struct connection
+    {
+        int fd;
+        uint64_t serial;
+
+        // Either a player or a spectator
+        std::unique_ptr<telnet> session;
+        std::unique_ptr<spectator> watcher;
+
+        bool closing, want_write;
+
+        uint8_t const *pending() const;
+        int pending_size() const;
+        void consume(int size);
+    };
+
+    int listen(int port);
+    void accept(int listen_fd);
+    bool receive(connection &c);
+    bool flush(connection &c);
+    void close(int fd);
+    void tick();
+
+    lol::String m_cart, m_encoder, m_spool;
+    int m_port, m_watch_port, m_compression, m_offload;
+    int m_listen_fd, m_watch_fd, m_epoll_fd;
+
+    std::map<int, std::unique_ptr<connection>> m_connections;
+    uint64_t m_serial, m_featured;
+    int m_ticks;
+    scheduler m_scheduler;
+    zygote m_zygote;
+    broadcast m_broadcast;
+};
+
+} // namespace z8
+
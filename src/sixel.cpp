@@ -0,0 +1,157 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#include <lol/engine.h>
+
+#include "sixel.h"
+
+namespace z8
+{
+
+sixel::sixel(lol::ivec2 term_size, int scale)
+  : m_scale(lol::clamp(scale, 1, 8)),
+    m_valid(false)
+{
+    UNUSED(term_size);
+}
+
+void sixel::resize(lol::ivec2 term_size)
+{
+    UNUSED(term_size);
+    m_valid = false;
+}
+
+void sixel::put(char const *str)
+{
+    while (*str)
+        m_buffer << (uint8_t)*str++;
+}
+
+void sixel::put(int n)
+{
+    if (n >= 10)
+        put(n / 10);
+    m_buffer << (uint8_t)('0' + n % 10);
+}
+
+// Emit “count” times the sixel “ch”, run length encoded when shorter
+void sixel::put_run(int ch, int count)
+{
+    if (count > 3)
+    {
+        put("!");
+        put(count);
+        m_buffer << (uint8_t)ch;
+    }
+    else
+    {
+        while (count--)
+            m_buffer << (uint8_t)ch;
+    }
+}
+
+lol::array<uint8_t> const &sixel::encode(vm const &vm)
+{
+    m_buffer.empty();
+
+    uint8_t pixels[128 * 128];
+    vm.render(pixels, 128, vm::pixel_format::indexed);
+
+    if (m_valid && !memcmp(pixels, m_pixels, sizeof(pixels)))
+        return m_buffer;
+
+    // On a full redraw, reset the terminal state and hide the cursor
+    if (!m_valid)
+        put("\x1b[0m\x1b[2J\x1b[?25l");
+
+    // Image at the top left, 1:1 pixel aspect, size in raster attributes
+    int size = 128 * m_scale;
+    put("\x1b[H\x1bP7;1q\"1;1;");
+    put(size); put(";"); put(size);
+
+    // Fixed colour registers, in percent
+    for (int i = 0; i < 16; ++i)
+    {
+        lol::u8vec4 c = palette::get(i);
+        put("#"); put(i); put(";2;");
+        put((c.r * 100 + 127) / 255); put(";");
+        put((c.g * 100 + 127) / 255); put(";");
+        put((c.b * 100 + 127) / 255);
+    }
+
+    // Each band is six output rows; each colour present in a band is
+    // drawn in its own pass over it
+    for (int y0 = 0; y0 < size; y0 += 6)
+    {
+        uint8_t const *rows[6];
+        uint16_t present = 0;
+        for (int i = 0; i < 6; ++i)
+        {
+            rows[i] = y0 + i < size ? pixels + (y0 + i) / m_scale * 128 : nullptr;
+            if (rows[i])
+                for (int x = 0; x < 128; ++x)
+                    present |= 1 << rows[i][x];
+        }
+
+        bool first = true;
+        for (int c = 0; c < 16; ++c)
+        {
+            if (!(present & (1 << c)))
+                continue;
+
+            if (!first)
+                put("$");
+            first = false;
+
+            put("#");
+            put(c);
+
+            // Sixels are the same for the m_scale output columns of a
+            // source pixel, so runs are computed on source pixels
+            int run_ch = -1, run = 0;
+            for (int x = 0; x < 128; ++x)
+            {
+                int bits = 0;
+                for (int i = 0; i < 6; ++i)
+                    if (rows[i] && rows[i][x] == c)
+                        bits |= 1 << i;
+
+                int ch = 0x3f + bits;
+                if (ch == run_ch)
+                {
+                    run += m_scale;
+                    continue;
+                }
+
+                if (run)
+                    put_run(run_ch, run);
+                run_ch = ch;
+                run = m_scale;
+            }
+
+            // Trailing blank sixels are not needed
+            if (run_ch != 0x3f)
+                put_run(run_ch, run);
+        }
+
+        put("-");
+    }
+
+    put("\x1b\\");
+
+    memcpy(m_pixels, pixels, sizeof(pixels));
+    m_valid = true;
+    return m_buffer;
+}
+
+} // namespace z8
+
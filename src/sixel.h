@@ -0,0 +1,59 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include "zepto8.h"
+#include "vm.h"
+#include "encoder.h"
+
+namespace z8
+{
+
+//
+// Encode the VM screen as a sixel image, with the 16 PICO-8 colours in
+// fixed colour registers so that display colours map to registers
+// directly. Sixel images cannot be patched, so any change causes the
+// whole image to be sent again; unchanged frames cost nothing.
+//
+
+class sixel : public encoder
+{
+public:
+    sixel(lol::ivec2 term_size = lol::ivec2(128, 64), int scale = 2);
+
+    virtual char const *name() const { return "sixel"; }
+
+    virtual void resize(lol::ivec2 term_size);
+    virtual void invalidate() { m_valid = false; }
+    virtual bool is_valid() const { return m_valid; }
+
+    virtual lol::array<uint8_t> const &encode(vm const &vm);
+
+private:
+    void put(char const *str);
+    void put(int n);
+    void put_run(int ch, int count);
+
+    int m_scale;
+    bool m_valid;
+
+    // Display colours of the last image sent
+    uint8_t m_pixels[128 * 128];
+
+    lol::array<uint8_t> m_buffer;
+};
+
+} // namespace z8
+
@@ -14,180 +14,957 @@
 
 #include <lol/engine.h>
 
+#include <chrono>
+#include <memory>
+
+#if HAVE_ZLIB_H
+#   include <zlib.h>
+#endif
+
 #if HAVE_UNISTD_H
 #   include <unistd.h>
+#   include <sys/uio.h>
+#   include <sys/ioctl.h>
 #endif
 
 #include "zepto8.h"
 #include "vm.h"
+#include "encoder.h"
+#include "zygote.h"
 
 namespace z8
 {
 
-struct telnet
+//
+// Decode the bytes sent by a telnet client into timestamped key events,
+// handling telnet commands and window size negotiation along the way.
+// Input is read into a ring buffer and parsed incrementally, so that a
+// sequence split across two reads is handled transparently.
+//
+
+class telnet_input
 {
-    lol::array<uint8_t> m_screen;
-    lol::ivec2 m_term_size = lol::ivec2(128, 64);
+public:
+    struct event
+    {
+        int key;
+        double time;
+    };
 
-    void run(char const *cart)
+    // Seconds since an arbitrary origin, for event timestamps
+    static double clock()
     {
-        disable_echo();
+        using namespace std::chrono;
+        return duration<double>(steady_clock::now().time_since_epoch()).count();
+    }
 
-        z8::vm vm;
-        vm.load(cart);
-        vm.run();
+    // The options we ask the client for
+    static void handshake(lol::array<uint8_t> &out, bool compress = false)
+    {
+        out << 0xff << 0xfb << 0x03  // WILL suppress go ahead (no line buffering)
+            << 0xff << 0xfe << 0x22  // DONT linemode (no idea what it does)
+            << 0xff << 0xfb << 0x01  // WILL echo (actually disables local echo)
+            << 0xff << 0xfd << 0x1f; // DO NAWS (window size negociation)
+        if (compress)
+            out << 0xff << 0xfb << 0x56; // WILL MCCP2 (compressed output)
+    }
 
-        while (true)
+    // Graphics capabilities of the client terminal
+    enum
+    {
+        cap_sixel = 1 << 0,
+        cap_kitty = 1 << 1,
+    };
+
+    // Ask the terminal what it can display: a kitty graphics query,
+    // then a primary device attributes request whose answer lists sixel
+    // support and tells that the kitty answer, if any, came first
+    static void query(lol::array<uint8_t> &out)
+    {
+        char const *str = "\x1b_Gi=31,s=1,v=1,a=q,t=d,f=24;AAAA\x1b\\\x1b[c";
+        while (*str)
+            out << (uint8_t)*str++;
+    }
+
+#if HAVE_UNISTD_H
+    // Drain what is available from fd with a single read(); returns
+    // the read() result, so 0 means the client went away
+    int read(int fd)
+    {
+        uint32_t start = m_head & ring_mask;
+        uint32_t free = ring_size - (m_head - m_tail);
+
+        struct iovec iov[2];
+        iov[0].iov_base = m_ring + start;
+        iov[0].iov_len = lol::min(free, ring_size - start);
+        iov[1].iov_base = m_ring;
+        iov[1].iov_len = free - iov[0].iov_len;
+
+        int bytes = (int)readv(fd, iov, iov[1].iov_len ? 2 : 1);
+        if (bytes > 0)
         {
-            lol::Timer t;
+            m_head += bytes;
+            parse(clock());
+        }
+        return bytes;
+    }
+#endif
+
+    // Append bytes received by other means
+    void push(uint8_t const *data, int size)
+    {
+        double time = clock();
+        while (size > 0)
+        {
+            int count = lol::min(size, (int)(ring_size - (m_head - m_tail)));
+            for (int i = 0; i < count; ++i)
+                m_ring[m_head++ & ring_mask] = data[i];
+            parse(time);
+            data += count;
+            size -= count;
+        }
+    }
+
+    // Get the next key event; returns false once there are none left
+    bool poll(event &e)
+    {
+        if (m_events.count() == 0)
+            return false;
+
+        e = m_events[m_event_pos++];
+        if (m_event_pos == m_events.count())
+        {
+            m_events.empty();
+            m_event_pos = 0;
+        }
+        return true;
+    }
 
-            for (int i = 0; i < 16; ++i)
-                vm.button(i, 0);
+    // Report a window size change since the last call
+    bool take_resize(lol::ivec2 &term_size)
+    {
+        if (!m_resized)
+            return false;
+        term_size = m_term_size;
+        m_resized = false;
+        return true;
+    }
+
+    // Report whether the terminal answered query() since the last call,
+    // and with which capabilities
+    bool take_caps(int &caps)
+    {
+        if (!m_caps_received)
+            return false;
+        caps = m_caps;
+        m_caps_received = false;
+        return true;
+    }
+
+    // Report whether the client answered our MCCP2 offer since the last
+    // call, and whether it accepted it
+    bool take_compress(bool &accepted)
+    {
+        if (m_compress < 0)
+            return false;
+        accepted = m_compress > 0;
+        m_compress = -1;
+        return true;
+    }
 
-            for (;;)
+private:
+    static uint32_t const ring_size = 4096, ring_mask = ring_size - 1;
+
+    // Keys beyond this count in a single frame are dropped
+    static int const max_events = 256;
+
+    enum class state : uint8_t
+    {
+        ground,
+        iac,        // IAC
+        option,     // IAC WILL/WONT/DO/DONT
+        sb,         // IAC SB
+        sb_data,    // IAC SB <option>
+        sb_iac,     // IAC SB <option> ... IAC
+        esc,        // ESC
+        csi,        // ESC [ or ESC O
+        apc,        // ESC _
+        apc_esc,    // ESC _ ... ESC
+    };
+
+    void emit(int key, double time)
+    {
+        if (m_events.count() - m_event_pos < max_events)
+            m_events.push(event { key, time });
+    }
+
+    void parse(double time)
+    {
+        for ( ; m_tail != m_head; ++m_tail)
+        {
+            uint8_t ch = m_ring[m_tail & ring_mask];
+
+            switch (m_state)
             {
-                int key = get_key();
-                if (key < 0)
+            case state::ground:
+                if (ch == 0xff)
+                    m_state = state::iac;
+                else if (ch == 0x1b)
+                    m_state = state::esc;
+                else
+                    emit(ch, time);
+                break;
+
+            case state::iac:
+                if (ch >= 0xfb && ch <= 0xfe)
+                {
+                    m_command = ch;
+                    m_state = state::option;
+                }
+                else if (ch == 0xfa)
+                    m_state = state::sb;
+                else
+                    m_state = state::ground;
+                break;
+
+            case state::option:
+                if (ch == 0x56 && (m_command == 0xfd || m_command == 0xfe))
+                    m_compress = m_command == 0xfd; // DO or DONT MCCP2
+                m_state = state::ground;
+                break;
+
+            case state::sb:
+                m_sb_option = ch;
+                m_sb_count = 0;
+                m_state = state::sb_data;
+                break;
+
+            case state::sb_data:
+                if (ch == 0xff)
+                    m_state = state::sb_iac;
+                else if (m_sb_count < (int)sizeof(m_sb))
+                    m_sb[m_sb_count++] = ch;
+                break;
+
+            case state::sb_iac:
+                if (ch == 0xff) // escaped 0xff data byte
+                {
+                    if (m_sb_count < (int)sizeof(m_sb))
+                        m_sb[m_sb_count++] = ch;
+                    m_state = state::sb_data;
                     break;
+                }
 
-                switch (key)
+                if (ch == 0xf0 && m_sb_option == 0x1f && m_sb_count >= 4) // NAWS
                 {
-                    /* For now, Escape quits */
-                    case 0x1b: return;
-
-                    case 0x144: vm.button(0, 1); break; // left
-                    case 0x143: vm.button(1, 1); break; // right
-                    case 0x141: vm.button(2, 1); break; // up
-                    case 0x142: vm.button(3, 1); break; // down
-                    case 'z': case 'Z':
-                    case 'c': case 'C':
-                    case 'n': case 'N': vm.button(4, 1); break;
-                    case 'x': case 'X':
-                    case 'v': case 'V':
-                    case 'm': case 'M': vm.button(5, 1); break;
-                    case '\r': case '\n': vm.button(6, 1); break;
-                    case 's': case 'S': vm.button(8, 1); break;
-                    case 'f': case 'F': vm.button(9, 1); break;
-                    case 'e': case 'E': vm.button(10, 1); break;
-                    case 'd': case 'D': vm.button(11, 1); break;
-                    case 'a': case 'A': vm.button(12, 1); break;
-                    case '\t':
-                    case 'q': case 'Q': vm.button(13, 1); break;
-                    default:
-                        lol::msg::info("Got unknown key %02x\n", key);
-                        break;
+                    m_term_size = lol::ivec2(m_sb[0] * 256 + m_sb[1],
+                                             m_sb[2] * 256 + m_sb[3]);
+                    m_resized = true;
                 }
+                m_state = state::ground;
+                break;
+
+            case state::esc:
+                if (ch == '[' || ch == 'O')
+                {
+                    m_seq_count = 0;
+                    m_state = state::csi;
+                    break;
+                }
+                if (ch == '_')
+                {
+                    m_seq_count = 0;
+                    m_state = state::apc;
+                    break;
+                }
+                // ESC ESC is the Escape key, ESC <key> is Alt+<key>
+                emit(ch, time);
+                m_state = state::ground;
+                break;
+
+            case state::csi:
+                // Keep parameters for device attributes, otherwise only
+                // report the final byte
+                if (ch >= 0x40 && ch <= 0x7e)
+                {
+                    if (ch == 'c' && m_seq_count && m_seq[0] == '?')
+                        device_attributes();
+                    else
+                        emit(0x100 + ch, time);
+                    m_state = state::ground;
+                }
+                else if (ch >= 0x20 && ch <= 0x3f)
+                {
+                    if (m_seq_count < (int)sizeof(m_seq))
+                        m_seq[m_seq_count++] = ch;
+                }
+                else
+                {
+                    m_state = state::ground;
+                }
+                break;
+
+            case state::apc:
+                if (ch == 0x1b)
+                    m_state = state::apc_esc;
+                else if (m_seq_count < (int)sizeof(m_seq))
+                    m_seq[m_seq_count++] = ch;
+                break;
+
+            case state::apc_esc:
+                // Answer to the kitty graphics query: “Gi=31;OK”
+                if (ch == '\\' && m_seq_count >= 4 && m_seq[0] == 'G'
+                     && !memcmp(m_seq + m_seq_count - 3, ";OK", 3))
+                    m_caps |= cap_kitty;
+                m_state = state::ground;
+                break;
             }
+        }
+    }
 
-            vm.step(1.f / 60.f);
+    // Answer to query(): “ESC [ ? 62 ; 4 ; ... c”, where 4 means sixel
+    void device_attributes()
+    {
+        for (int i = 1, n = 0; i <= m_seq_count; ++i)
+        {
+            if (i < m_seq_count && m_seq[i] >= '0' && m_seq[i] <= '9')
+            {
+                n = n * 10 + m_seq[i] - '0';
+                continue;
+            }
+            if (n == 4)
+                m_caps |= cap_sixel;
+            n = 0;
+        }
+        m_caps_received = true;
+    }
 
-            vm.print_ansi(m_term_size,
-                          m_screen.count() ? m_screen.data() : nullptr);
+    uint8_t m_ring[ring_size];
+    uint32_t m_head = 0, m_tail = 0;
+    state m_state = state::ground;
+    uint8_t m_command = 0;
 
-            m_screen.resize(SIZE_SCREEN);
-            ::memcpy(m_screen.data(), vm.get_mem(OFFSET_SCREEN), SIZE_SCREEN);
+    uint8_t m_sb[8];
+    int m_sb_option = 0, m_sb_count = 0;
 
-            t.Wait(1.f / 60.f);
-        }
+    // Parameters of the current CSI or APC sequence
+    char m_seq[32];
+    int m_seq_count = 0;
+    int m_caps = 0;
+    bool m_caps_received = false;
+
+    lol::array<event> m_events;
+    int m_event_pos = 0;
+
+    lol::ivec2 m_term_size;
+    bool m_resized = false;
+    int m_compress = -1;
+};
+
+//
+// A telnet session: one VM, fed with the bytes received from the client,
+// producing the bytes to send back. It does no I/O by itself, so that it
+// can be driven either by run() on stdin/stdout or by z8::server.
+//
+
+class telnet
+{
+public:
+    void load(char const *cart)
+    {
+        m_cart = cart;
+        m_activity = activity::starting;
+
+        lol::array<uint8_t> message;
+        telnet_input::handshake(message, m_zlevel > 0);
+
+        // Start with ANSI, and switch if the terminal can do better
+        bool detect = !strcmp(m_encoder_name.C(), "auto");
+        m_encoder.reset(encoder::create(detect ? "ansi" : m_encoder_name.C(),
+                                        m_term_size));
+        if (!m_encoder)
+            m_encoder.reset(encoder::create("ansi", m_term_size));
+        if (detect)
+            telnet_input::query(message);
+
+        output(message);
     }
 
-    void disable_echo()
+    ~telnet()
     {
-#if HAVE_UNISTD_H
-        uint8_t const message[] =
-        {
-            0xff, 0xfb, 0x03, // WILL suppress go ahead (no line buffering)
-            0xff, 0xfe, 0x22, // DONT linemode (no idea what it does)
-            0xff, 0xfb, 0x01, // WILL echo (actually disables local echo)
-            0xff, 0xfd, 0x1f, // DO NAWS (window size negociation)
-        };
+#if HAVE_ZLIB_H
+        if (m_zstream)
+            deflateEnd(m_zstream.get());
+#endif
+        if (m_state_size)
+            remove(m_state_path.C());
+    }
 
-        write(STDOUT_FILENO, message, sizeof(message));
+    // Offer MCCP2 compression at this zlib level (1–9), or 0 to disable;
+    // must be called before load()
+    void set_compression(int level)
+    {
+#if HAVE_ZLIB_H
+        m_zlevel = lol::clamp(level, 0, 9);
+#else
+        UNUSED(level);
 #endif
     }
 
-    int get_key()
+    // Use this encoder (“ansi”, “sixel”, “kitty”), or “auto” to pick the
+    // best one the terminal supports; must be called before load()
+    void set_encoder(char const *name)
     {
-#if HAVE_UNISTD_H
-        static lol::String seq;
+        m_encoder_name = name;
+    }
+
+    char const *encoder_name() const { return m_encoder->name(); }
+
+    // Take VMs from this pool instead of building them, so that sessions
+    // wait for one without holding up the others; must be called before
+    // load()
+    void set_zygote(zygote *z)
+    {
+        m_zygote = z;
+    }
+
+    // CPU budget for the VM during the next steps, see vm::set_budget()
+    void set_budget(int cycles, double seconds)
+    {
+        m_budget = cycles;
+        m_time_budget = seconds;
+    }
 
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(STDIN_FILENO, &fds);
+    // Whether the VM ran out of budget during the last step()
+    bool exhausted() const { return m_exhausted; }
 
-        struct timeval tv;
-        tv.tv_sec = tv.tv_usec = 0;
+    // Save suspended sessions to the given file and free their VM after
+    // this many seconds, or never if 0; they are restored on the next
+    // key press. The file is only open while saving or restoring.
+    void set_offload(double seconds, char const *path)
+    {
+        m_offload = lol::max(seconds, 0.0);
+        m_state_path = path;
+    }
 
-        select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv);
+    // Why the VM could not be offloaded, or nullptr; until the next key
+    // press, the session is not offloaded again
+    char const *unsaveable() const { return m_unsaveable; }
+
+    // Append bytes received from the client
+    void input(uint8_t const *data, int size)
+    {
+        m_input.push(data, size);
+    }
 
-        if (!FD_ISSET(0, &fds))
-            return -1;
+#if HAVE_UNISTD_H
+    // Read what the client sent with a single read() call
+    int read(int fd)
+    {
+        return m_input.read(fd);
+    }
+#endif
 
-        char ch;
-        if (read(STDIN_FILENO, &ch, 1) <= 0)
-            exit(EXIT_SUCCESS);
+    struct stats
+    {
+        int64_t frames_sent = 0, frames_skipped = 0, bytes_sent = 0;
+        float fps = 0.f; // frames sent per second, over the last second
 
-        if (ch != '\x1b' && ch != '\xff' && seq.count() == 0)
-            return ch;
+        // Output size before compression, equal to the compressed size
+        // if compression is disabled
+        int64_t bytes_raw = 0, bytes_compressed = 0;
 
-        seq += ch;
+        // VM steps, and the time spent collecting garbage after them
+        int64_t frames_stepped = 0;
+        double gc_seconds = 0.0;
+    };
 
-        // TELNET commands
-        if (seq[0] == '\xff') // telnet commands
+#if HAVE_UNISTD_H
+    // Whether the client kept up with what we sent so far: nothing left
+    // in our buffer, and not much left unacknowledged in the kernel’s
+    static bool can_send(int fd, int pending)
+    {
+        if (pending)
+            return false;
+#if defined TIOCOUTQ
+        int queued = 0;
+        if (ioctl(fd, TIOCOUTQ, &queued) == 0)
+            return queued < max_unacked;
+#else
+        UNUSED(fd);
+#endif
+        return true;
+    }
+#endif
+
+    // Run one frame, and encode it unless “send” is false because the
+    // client is lagging; returns false when the session ends
+    bool step(bool send = true)
+    {
+        double now = telnet_input::clock();
+
+        // Terminals only send key presses, repeated while the key is held,
+        // so a button stays down for a short while after each press.
+        for (telnet_input::event e; m_input.poll(e); )
         {
-            if (seq[1] >= '\xfb' && seq[1] <= '\xfe')
+            /* For now, Escape quits */
+            if (e.key == 0x1b)
             {
-                if (seq[2] == 0)
-                    return -1; // wait for more data
-                goto reset;
+                finish();
+                return false;
             }
-            else if (seq[1] == '\xfa') // subnegociation
+
+            int index = button_index(e.key);
+            if (index < 0)
             {
-                if (seq[2] == 0)
-                    return -1; // wait for more data
-                if (seq[2] != '\x1f')
-                    goto reset; // can’t happen
-                if (seq.count() < 9)
-                    return -1; // wait for more data
-                m_term_size.x = (uint8_t)seq[3] * 256 + (uint8_t)seq[4];
-                m_term_size.y = (uint8_t)seq[5] * 256 + (uint8_t)seq[6];
-                printf("\x1b[2J"); // clear screen
-                m_screen.empty();
-                goto reset;
+                lol::msg::info("Got unknown key %02x\n", e.key);
+                continue;
             }
-            else if (seq.count() >= 3)
+
+            m_release[index] = lol::max(m_release[index],
+                                        lol::max(e.time + hold_time, now));
+        }
+
+        if (m_input.take_resize(m_term_size))
+            m_encoder->resize(m_term_size);
+
+        int caps;
+        if (m_input.take_caps(caps))
+        {
+            char const *name = caps & telnet_input::cap_kitty ? "kitty"
+                             : caps & telnet_input::cap_sixel ? "sixel" : "ansi";
+            if (strcmp(name, m_encoder->name()))
+                m_encoder.reset(encoder::create(name, m_term_size));
+        }
+
+        bool accepted;
+        if (m_input.take_compress(accepted) && accepted)
+            start_compression();
+
+        // Idle sessions are stepped less often, or not at all until
+        // the next key press
+        bool input = false;
+        for (int i = 0; i < 16; ++i)
+            input |= now <= m_release[i];
+
+        // An offloaded session is brought back when there is something
+        // to do; until then the terminal keeps showing the last frame.
+        if (m_activity == activity::offloaded)
+        {
+            if (!input && m_encoder->is_valid())
+                return true;
+            m_activity = activity::starting;
+        }
+
+        // Until a VM is available the session only handles input; the
+        // saved state, if any, is restored once it arrives
+        if (m_activity == activity::starting && !start_vm())
+            return true;
+
+        for (int i = 0; i < 16; ++i)
+            m_vm->button(i, now <= m_release[i]);
+
+        if (input)
+        {
+            m_activity = activity::active;
+            m_unsaveable = nullptr;
+        }
+
+        m_dirty = m_exhausted = false;
+        if (m_activity == activity::active
+             || (m_activity == activity::throttled && ++m_throttled >= throttle_ratio))
+        {
+            m_throttled = 0;
+            m_vm->set_budget(m_budget, m_time_budget);
+            m_vm->step(1.f / 60.f);
+            m_exhausted = m_vm->exhausted();
+            ++m_stats.frames_stepped;
+            m_stats.gc_seconds += m_vm->gc_time();
+
+            uint64_t dirty[2];
+            m_vm->take_dirty(dirty);
+            m_dirty = (dirty[0] | dirty[1]) != 0;
+
+            update_activity(input);
+            m_suspend_time = now;
+        }
+
+        // Nothing to send if the screen did not change, unless the
+        // terminal was resized and needs a full redraw
+        m_unsent |= m_dirty;
+
+        // The VM keeps running at 60 Hz; a lagging client simply misses
+        // some frames, and later gets the difference with what it has.
+        if (!send)
+        {
+            m_stats.frames_skipped += m_dirty; // only new frames count
+        }
+        else if (m_unsent || !m_encoder->is_valid())
+        {
+            lol::array<uint8_t> const &data = m_encoder->encode(*m_vm);
+            if (data.count())
+            {
+                output(data);
+                ++m_stats.frames_sent;
+                ++m_window_frames;
+            }
+            m_unsent = false;
+        }
+
+        if (now >= m_window_start + 1.0)
+        {
+            m_stats.fps = m_window_start > 0.0
+                        ? (float)(m_window_frames / (now - m_window_start)) : 0.f;
+            m_window_start = now;
+            m_window_frames = 0;
+        }
+
+        // Offload once everything was sent, since the encoder needs the
+        // VM to redraw anything
+        if (m_offload > 0.0 && m_activity == activity::suspended && !m_unsent
+             && !m_unsaveable && now >= m_suspend_time + m_offload)
+            offload_vm(now);
+
+        return true;
+    }
+
+    stats const &get_stats() const { return m_stats; }
+
+    enum class activity
+    {
+        starting,  // waiting for a VM, to start or restore the session
+        active,
+        throttled, // idle: stepped at a reduced rate
+        suspended, // idle for long: not stepped until input arrives
+        offloaded, // suspended for long: saved to disk, VM freed
+    };
+
+    activity get_activity() const { return m_activity; }
+
+    // The VM, and whether its screen changed during the last step(); the
+    // VM does not exist while the session is starting or offloaded
+    bool has_vm() const { return m_vm != nullptr; }
+    vm const &get_vm() const { return *m_vm; }
+    bool dirty() const { return m_dirty; }
+
+    // Bytes waiting to be sent to the client
+    uint8_t const *pending() const { return m_output.data() + m_output_pos; }
+    int pending_size() const { return m_output.count() - m_output_pos; }
+
+    // Tell that the first “size” pending bytes were sent
+    void consume(int size)
+    {
+        m_stats.bytes_sent += size;
+        m_output_pos += size;
+        if (m_output_pos == m_output.count())
+        {
+            m_output.empty();
+            m_output_pos = 0;
+        }
+    }
+
+    // Serve a single client on stdin/stdout, for use with inetd
+    void run(char const *cart)
+    {
+#if HAVE_UNISTD_H
+        load(cart);
+
+        while (true)
+        {
+            lol::Timer t;
+
+            // Read whatever is available without blocking
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(STDIN_FILENO, &fds);
+
+            struct timeval tv;
+            tv.tv_sec = tv.tv_usec = 0;
+
+            if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) > 0
+                 && read(STDIN_FILENO) <= 0)
+                exit(EXIT_SUCCESS);
+
+            bool running = step(can_send(STDOUT_FILENO, pending_size()));
+
+            while (pending_size())
             {
-                goto reset;
+                int bytes = (int)write(STDOUT_FILENO, pending(), pending_size());
+                if (bytes <= 0)
+                    exit(EXIT_SUCCESS);
+                consume(bytes);
             }
 
-            return -1;
+            if (!running)
+                return;
+
+            t.Wait(1.f / 60.f);
         }
+#else
+        UNUSED(cart);
+#endif
+    }
+
+private:
+    // How long a button stays down after a key press; long enough to
+    // bridge the gaps between the repeats of a held key
+    static constexpr double hold_time = 0.05;
 
-        // Escape sequences
-        if (seq[0] == '\x1b')
+    // Stop sending frames while more than this is in flight
+    static int const max_unacked = 16384;
+
+    // A session is idle after this many steps without input, sound or
+    // visible change; it is then stepped once every throttle_ratio
+    // frames, and suspended after suspend_steps. Carts that read time()
+    // may be waiting for it, so they are throttled but never suspended.
+    static int const idle_steps = 300;
+    static int const throttle_ratio = 4;
+    static int const suspend_steps = idle_steps + 900;
+
+    void update_activity(bool input)
+    {
+        // FNV-1a over the screen and display palette, 64 bits at a time
+        uint64_t hash = 0xcbf29ce484222325ull;
+        uint64_t word;
+        uint8_t const *screen = m_vm->get_mem(OFFSET_SCREEN);
+        for (int i = 0; i < SIZE_SCREEN; i += 8)
         {
-            if (seq[1] == '\x5b')
+            memcpy(&word, screen + i, 8);
+            hash = (hash ^ word) * 0x100000001b3ull;
+        }
+        for (int i = 0; i < 16; i += 8)
+        {
+            memcpy(&word, m_vm->get_display_pal() + i, 8);
+            hash = (hash ^ word) * 0x100000001b3ull;
+        }
+
+        if (!input && hash == m_hash && m_vm->is_silent())
+            m_idle_steps = lol::min(m_idle_steps + 1, suspend_steps);
+        else
+            m_idle_steps = 0;
+        m_hash = hash;
+
+        m_activity = m_idle_steps < idle_steps ? activity::active
+                   : m_idle_steps < suspend_steps || m_vm->uses_time() ? activity::throttled
+                   : activity::suspended;
+    }
+
+    void offload_vm(double now)
+    {
+        // Saving fails if the VM was interrupted in the middle of a frame,
+        // or if the cart holds values that cannot be saved; the latter
+        // will not go away by themselves, so only try again after input.
+        lol::array<uint8_t> blob;
+        if (!m_vm->save(blob))
+        {
+            if (m_vm->save_error() != vm::save_busy)
+                m_unsaveable = m_vm->save_error();
+            m_suspend_time = now;
+            return;
+        }
+
+        FILE *f = fopen(m_state_path.C(), "wb");
+        bool ok = f && fwrite(blob.data(), 1, blob.count(), f) == (size_t)blob.count();
+        if (f && fclose(f) != 0)
+            ok = false;
+        if (!ok)
+        {
+            lol::msg::error("cannot write %s\n", m_state_path.C());
+            remove(m_state_path.C());
+            m_suspend_time = now;
+            return;
+        }
+
+        m_state_size = blob.count();
+        m_vm.reset();
+        m_activity = activity::offloaded;
+    }
+
+    bool start_vm()
+    {
+        m_vm = new_vm();
+        if (!m_vm)
+            return false;
+
+        if (m_state_size)
+        {
+            lol::array<uint8_t> blob;
+            blob.resize(m_state_size);
+            FILE *f = fopen(m_state_path.C(), "rb");
+            bool ok = f && fread(blob.data(), 1, blob.count(), f) == (size_t)blob.count();
+            if (f)
+                fclose(f);
+            remove(m_state_path.C());
+            m_state_size = 0;
+
+            // A VM that did not start the cart yet still has pristine
+            // globals; if restoring fails, start over on the next VM
+            // rather than drop the client
+            if (!ok || !m_vm->restore(blob))
             {
-                if (seq[2] == 0)
-                    return -1; // wait for more data
-                int ret = 0x100 + seq[2];
-                seq = "";
-                return ret;
+                lol::msg::error("cannot restore session, restarting cart\n");
+                m_vm.reset();
+                m_encoder->invalidate();
+                return false;
             }
-            else if (seq[1] == '\x1b')
+        }
+
+        m_activity = activity::active;
+        m_idle_steps = 0;
+        return true;
+    }
+
+    // A VM that ran run() on the cart, but not its first frame yet; the
+    // zygote may not have one ready, in which case this is empty
+    std::unique_ptr<vm> new_vm()
+    {
+        if (m_zygote && m_zygote->valid())
+            return m_zygote->take();
+
+        std::unique_ptr<vm> ret(new vm());
+        ret->load(m_cart.C());
+        ret->run();
+        return ret;
+    }
+
+    static int button_index(int key)
+    {
+        switch (key)
+        {
+            case 0x144: return 0; // left
+            case 0x143: return 1; // right
+            case 0x141: return 2; // up
+            case 0x142: return 3; // down
+            case 'z': case 'Z':
+            case 'c': case 'C':
+            case 'n': case 'N': return 4;
+            case 'x': case 'X':
+            case 'v': case 'V':
+            case 'm': case 'M': return 5;
+            case '\r': case '\n': return 6;
+            case 's': case 'S': return 8;
+            case 'f': case 'F': return 9;
+            case 'e': case 'E': return 10;
+            case 'd': case 'D': return 11;
+            case 'a': case 'A': return 12;
+            case '\t':
+            case 'q': case 'Q': return 13;
+            default: return -1;
+        }
+    }
+
+    // Restore the terminal at the end of the session
+    void finish()
+    {
+        lol::array<uint8_t> data;
+        for (char const *str = m_encoder->teardown(); *str; ++str)
+            data << (uint8_t)*str;
+        output(data);
+    }
+
+    // Queue data for the client, compressed if MCCP2 is active; each
+    // call is flushed so that the client can display it right away.
+    void output(lol::array<uint8_t> const &data)
+    {
+        m_stats.bytes_raw += data.count();
+
+#if HAVE_ZLIB_H
+        if (m_zstream)
+        {
+            z_stream *z = m_zstream.get();
+            z->next_in = const_cast<Bytef *>(data.data());
+            z->avail_in = (uInt)data.count();
+
+            int start = m_output.count();
+            do
             {
-                seq = "";
-                return '\x1b';
+                // Grow the output buffer and deflate into the new space
+                int size = m_output.count();
+                int room = (int)deflateBound(z, z->avail_in) + 16;
+                m_output.resize(size + room);
+                z->next_out = m_output.data() + size;
+                z->avail_out = (uInt)room;
+                deflate(z, Z_SYNC_FLUSH);
+                m_output.resize(size + room - (int)z->avail_out);
             }
+            while (z->avail_in > 0 || z->avail_out == 0);
 
-            return -1;
+            m_stats.bytes_compressed += m_output.count() - start;
+            return;
         }
+#endif
+
+        for (int i = 0; i < data.count(); ++i)
+            m_output << data[i];
+        m_stats.bytes_compressed += data.count();
+    }
 
-reset:
-        seq = "";
+    // The client accepted MCCP2: everything after IAC SB MCCP2 IAC SE
+    // is part of a single zlib stream.
+    void start_compression()
+    {
+#if HAVE_ZLIB_H
+        if (m_zstream || m_zlevel <= 0)
+            return;
+
+        // The client starts inflating right after IAC SB MCCP2 IAC SE,
+        // so only send it once the stream is ready, and otherwise take
+        // back our offer. The marker itself is not compressed.
+        std::unique_ptr<z_stream> z(new z_stream);
+        memset(z.get(), 0, sizeof(z_stream));
+        bool ok = deflateInit(z.get(), m_zlevel) == Z_OK;
+
+        lol::array<uint8_t> message;
+        if (ok)
+            message << 0xff << 0xfa << 0x56 << 0xff << 0xf0; // IAC SB MCCP2 IAC SE
+        else
+            message << 0xff << 0xfc << 0x56; // IAC WONT MCCP2
+        output(message);
+
+        if (ok)
+            m_zstream = std::move(z);
+        else
+            m_zlevel = 0;
 #endif
-        return -1;
     }
+
+    lol::String m_cart;
+    zygote *m_zygote = nullptr;
+    std::unique_ptr<vm> m_vm;
+    std::unique_ptr<encoder> m_encoder;
+    lol::String m_encoder_name = "auto";
+    lol::ivec2 m_term_size = lol::ivec2(128, 64);
+    bool m_dirty = false, m_unsent = false;
+
+    int m_budget = vm::default_budget;
+    double m_time_budget = 0.0;
+    bool m_exhausted = false;
+
+    activity m_activity = activity::active;
+    int m_idle_steps = 0, m_throttled = 0;
+    uint64_t m_hash = 0;
+
+    // Offloading: delay, time of the last VM step, and saved state
+    double m_offload = 0.0, m_suspend_time = 0.0;
+    lol::String m_state_path;
+    int m_state_size = 0;
+    char const *m_unsaveable = nullptr;
+
+    stats m_stats;
+    double m_window_start = 0.0;
+    int m_window_frames = 0;
+
+    telnet_input m_input;
+    double m_release[16] = {};
+
+#if HAVE_ZLIB_H
+    std::unique_ptr<z_stream> m_zstream;
+    int m_zlevel = 6;
+#else
+    int m_zlevel = 0;
+#endif
+    lol::array<uint8_t> m_output;
+    int m_output_pos = 0;
 };
 
 } // namespace z8
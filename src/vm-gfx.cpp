@@ -32,6 +32,47 @@ void vm::setpixel(int x, int y, int color)
     int mask = (x & 1) ? 0x0f : 0xf0;
     int p = (x & 1) ? color << 4 : color;
     m_memory[offset] = (m_memory[offset] & mask) | p;
+    m_dirty[y / 64] |= uint64_t(1) << (y % 64);
+}
+
+// Same as setpixel(), but honours the fill pattern
+void vm::plot(int x, int y, int color)
+{
+    color = pattern_color(x - m_camera.x, y - m_camera.y, color);
+    if (color >= 0)
+        setpixel(x, y, color);
+}
+
+// The palette-mapped draw colour, with the secondary colour used by
+// the fill pattern in the high nibble if a pattern is active.
+int vm::fill_color() const
+{
+    int c = m_pal[0][m_color & 0xf];
+    return m_fillp ? c | (m_pal[0][m_color >> 4] << 4) : c;
+}
+
+// How many pixels of the w×h rectangle at (x,y), in camera coordinates,
+// fall inside the clipping rectangle; only those are paid for.
+int vm::clipped_area(int x, int y, int w, int h) const
+{
+    if (w <= 0 || h <= 0)
+        return 0;
+
+    x -= m_camera.x;
+    y -= m_camera.y;
+    int cw = lol::min(x + w, m_clip.bb.x) - lol::max(x, m_clip.aa.x);
+    int ch = lol::min(y + h, m_clip.bb.y) - lol::max(y, m_clip.aa.y);
+    return cw > 0 && ch > 0 ? cw * ch : 0;
+}
+
+// The colour of screen pixel (x,y) according to the fill pattern, or
+// -1 if the pattern makes it transparent.
+int vm::pattern_color(int x, int y, int color) const
+{
+    // Bit 15 of the pattern is the top left pixel of the 4×4 tile
+    if (!(m_fillp & (0x8000 >> (4 * (y & 3) + (x & 3)))))
+        return color & 0xf;
+    return m_fillp_trans ? -1 : color >> 4;
 }
 
 int vm::getpixel(int x, int y)
@@ -86,7 +127,37 @@ void vm::hline(int x1, int x2, int y, int color)
     if (x1 > x2)
         return;
 
+    m_dirty[y / 64] |= uint64_t(1) << (y % 64);
+
     int offset = OFFSET_SCREEN + (128 * y) / 2;
+
+    if (m_fillp)
+    {
+        // Expand this row of the fill pattern to a 16-bit mask covering
+        // four pixels, i.e. two bytes of screen memory.
+        int bits = m_fillp >> (12 - 4 * (y & 3));
+        uint16_t mask = ((bits & 8) ? 0x000f : 0) | ((bits & 4) ? 0x00f0 : 0)
+                      | ((bits & 2) ? 0x0f00 : 0) | ((bits & 1) ? 0xf000 : 0);
+        uint16_t value = ((color & 0xf) * 0x1111 & ~mask)
+                       | ((color >> 4) * 0x1111 & mask);
+        uint16_t write = m_fillp_trans ? ~mask : 0xffff;
+
+        for (int x = x1 & ~1; x <= x2; x += 2)
+        {
+            int shift = (x & 2) ? 8 : 0;
+            uint8_t v = value >> shift, w = write >> shift;
+            if (x < x1)
+                w &= 0xf0;
+            if (x + 1 > x2)
+                w &= 0x0f;
+
+            uint8_t &dst = m_memory[offset + x / 2];
+            dst = (dst & ~w) | (v & w);
+        }
+
+        return;
+    }
+
     if (x1 & 1)
     {
         m_memory[offset + x1 / 2]
@@ -122,16 +193,209 @@ void vm::vline(int x, int y1, int y2, int color)
     if (y1 > y2)
         return;
 
+    dirty(y1, y2);
+
     int mask = (x & 1) ? 0x0f : 0xf0;
-    int p = (x & 1) ? color << 4 : color;
 
     for (int y = y1; y <= y2; ++y)
     {
+        int c = m_fillp ? pattern_color(x, y, color) : color;
+        if (c < 0)
+            continue;
+
         int offset = OFFSET_SCREEN + (128 * y + x) / 2;
+        int p = (x & 1) ? c << 4 : c;
         m_memory[offset] = (m_memory[offset] & mask) | p;
     }
 }
 
+// Draw “count” rows of a shape, starting at row y, given as one
+// [left, right] span per row (empty rows have left > right). The spans
+// array must also contain the rows just above and below the drawn ones,
+// in spans[0] and spans[count + 1], so that outlines can be computed.
+void vm::draw_spans(int y, lol::ivec2 const *spans, int count,
+                    bool fill, int color)
+{
+    for (int n = 1; n <= count; ++n)
+    {
+        lol::ivec2 span = spans[n];
+        if (span.x > span.y)
+            continue;
+
+        if (fill)
+        {
+            hline(span.x, span.y, y + n - 1, color);
+            continue;
+        }
+
+        // A pixel is on the outline if one of its four neighbours is not
+        // in the shape, so we can only skip the part of the row that is
+        // also covered by both the row above and the row below.
+        int inner_x0 = lol::max(lol::max(spans[n - 1].x, spans[n + 1].x),
+                                span.x + 1);
+        int inner_x1 = lol::min(lol::min(spans[n - 1].y, spans[n + 1].y),
+                                span.y - 1);
+
+        if (inner_x0 > inner_x1)
+        {
+            hline(span.x, span.y, y + n - 1, color);
+        }
+        else
+        {
+            hline(span.x, inner_x0 - 1, y + n - 1, color);
+            hline(inner_x1 + 1, span.y, y + n - 1, color);
+        }
+    }
+}
+
+void vm::circle(int x, int y, int r, bool fill, int color)
+{
+    // Only compute the rows that may be visible
+    int y0 = lol::max(y - r, m_clip.aa.y + m_camera.y);
+    int y1 = lol::min(y + r, m_clip.bb.y + m_camera.y - 1);
+    if (y0 > y1)
+        return;
+
+    // Half width of each row, including one extra row above and below
+    int count = y1 - y0 + 1;
+    int widths[128 + 2];
+    for (int n = 0; n < count + 2; ++n)
+        widths[n] = -1;
+
+    auto widen = [&](int row, int w)
+    {
+        row -= y0 - 1;
+        if (row >= 0 && row < count + 2)
+            widths[row] = lol::max(widths[row], w);
+    };
+
+    for (int dx = r, dy = 0, err = 0; dx >= dy; )
+    {
+        widen(y - dy, dx);
+        widen(y + dy, dx);
+        widen(y - dx, dy);
+        widen(y + dx, dy);
+
+        dy += 1;
+        err += 1 + 2 * dy;
+        // XXX: original Bresenham has a different test, but
+        // this one seems to match PICO-8 better.
+        if (2 * (err - dx) > r + 1)
+        {
+            dx -= 1;
+            err += 1 - 2 * dx;
+        }
+    }
+
+    lol::ivec2 spans[128 + 2];
+    for (int n = 0; n < count + 2; ++n)
+        spans[n] = lol::ivec2(x - widths[n], x + widths[n]);
+
+    draw_spans(y0, spans, count, fill, color);
+}
+
+void vm::ellipse(int x0, int y0, int x1, int y1, bool fill, int color)
+{
+    if (x0 > x1)
+        std::swap(x0, x1);
+
+    if (y0 > y1)
+        std::swap(y0, y1);
+
+    // Only compute the rows that may be visible
+    int ymin = lol::max(y0, m_clip.aa.y + m_camera.y);
+    int ymax = lol::min(y1, m_clip.bb.y + m_camera.y - 1);
+    if (ymin > ymax)
+        return;
+
+    // Pixel centres inside the ellipse that touches the outer edges
+    // of the bounding box pixels are part of the shape.
+    double cx = 0.5 * (x0 + x1), rx = 0.5 * (x1 - x0) + 0.5;
+    double cy = 0.5 * (y0 + y1), ry = 0.5 * (y1 - y0) + 0.5;
+
+    int count = ymax - ymin + 1;
+    lol::ivec2 spans[128 + 2];
+    for (int n = 0; n < count + 2; ++n)
+    {
+        int y = ymin - 1 + n;
+        if (y < y0 || y > y1)
+        {
+            spans[n] = lol::ivec2(0, -1);
+            continue;
+        }
+
+        double dy = (y - cy) / ry;
+        double dx = rx * lol::sqrt(lol::max(0.0, 1.0 - dy * dy));
+
+        // Never leave a row empty, even at the very top or bottom
+        spans[n] = lol::ivec2(lol::min(lol::ceil(cx - dx), lol::floor(cx)),
+                              lol::max(lol::floor(cx + dx), lol::ceil(cx)));
+    }
+
+    draw_spans(ymin, spans, count, fill, color);
+}
+
+// Fill a polygon given as “count” interleaved x,y coordinates, using the
+// even-odd rule. Pixels are sampled at their centre; samples exactly on
+// an edge follow the top-left rule, so that polygons sharing an edge
+// never overlap nor leave gaps.
+void vm::polygon(double const *coords, int count, int color)
+{
+    if (count < 3)
+        return;
+
+    double ymin = coords[1], ymax = coords[1];
+    for (int i = 1; i < count; ++i)
+    {
+        ymin = lol::min(ymin, coords[2 * i + 1]);
+        ymax = lol::max(ymax, coords[2 * i + 1]);
+    }
+
+    // Rows whose centre is in [ymin, ymax), restricted to visible rows
+    int y0 = lol::max((int)lol::ceil(ymin - 0.5), m_clip.aa.y + m_camera.y);
+    int y1 = lol::min((int)lol::ceil(ymax - 0.5), m_clip.bb.y + m_camera.y);
+
+    // Each row crosses at most one edge per vertex
+    double small_xs[16];
+    lol::array<double> large_xs;
+    if (count > 16)
+        large_xs.resize(count);
+    double *xs = count > 16 ? large_xs.data() : small_xs;
+
+    for (int y = y0; y < y1; ++y)
+    {
+        double yc = y + 0.5;
+        int n = 0;
+
+        // Gather the edges crossing this row; the upper end of an edge
+        // is included and the lower end is not.
+        for (int i = 0, j = count - 1; i < count; j = i++)
+        {
+            double xa = coords[2 * j], ya = coords[2 * j + 1];
+            double xb = coords[2 * i], yb = coords[2 * i + 1];
+            if ((ya <= yc && yc < yb) || (yb <= yc && yc < ya))
+            {
+                double x = xa + (yc - ya) * (xb - xa) / (yb - ya);
+
+                // Insertion sort, there are usually only two crossings
+                int k = n++;
+                for (; k > 0 && xs[k - 1] > x; --k)
+                    xs[k] = xs[k - 1];
+                xs[k] = x;
+            }
+        }
+
+        // Pixels whose centre is in [left, right) are drawn
+        for (int k = 0; k + 1 < n; k += 2)
+        {
+            int x0 = (int)lol::ceil(xs[k] - 0.5);
+            int x1 = (int)lol::ceil(xs[k + 1] - 0.5) - 1;
+            if (x0 <= x1)
+                hline(x0, x1, y, color);
+        }
+    }
+}
+
 //
 // Text
 //
@@ -164,15 +428,22 @@ int vm::api::print(lua_State *l)
     else
         str = lua_toboolean(l, 1) ? "true" : "false";
 
+    if (that->m_echo)
+    {
+        fprintf(stdout, "%s\n", str);
+        fflush(stdout);
+    }
+
     bool use_cursor = lua_isnone(l, 2) || lua_isnone(l, 3);
     int x = use_cursor ? that->m_cursor.x : lua_toclamp64(l, 2);
     int y = use_cursor ? that->m_cursor.y : lua_toclamp64(l, 3);
     if (!lua_isnone(l, 4))
         that->m_color = (int)lua_toclamp64(l, 4) & 0xf;
-    int c = that->m_pal[0][that->m_color];
+    int c = that->m_pal[0][that->m_color & 0xf];
     int initial_x = x;
 
-    auto pixels = that->m_font.Lock<lol::PixelFormat::RGBA_8>();
+    lol::ibox2 const &clip = that->m_clip;
+
     for (int n = 0; str[n]; ++n)
     {
         int ch = (int)(uint8_t)str[n];
@@ -188,19 +459,42 @@ int vm::api::print(lua_State *l)
             int w = index < 0x60 ? 4 : 8;
             int h = 6;
 
-            for (int dy = 0; dy < h - 1; ++dy)
-                for (int dx = 0; dx < w - 1; ++dx)
+            uint8_t const *glyph = that->m_font[index];
+            int sx = x - that->m_camera.x;
+            int sy = y - that->m_camera.y;
+
+            if (sx >= clip.aa.x && sx + w - 1 <= clip.bb.x
+                 && sy >= clip.aa.y && sy + h - 1 <= clip.bb.y)
+            {
+                // Fast path: the glyph is fully visible, so write its
+                // pixels directly into screen memory.
+                that->dirty(sy, sy + h - 2);
+                for (int dy = 0; dy < h - 1; ++dy)
                 {
-                    if (pixels[(index / 16 * h + dy) * 128 + (index % 16 * w + dx)].r > 0)
-                        that->setpixel(x + dx, y + dy, c);
+                    uint8_t *line = that->get_mem(OFFSET_SCREEN + (sy + dy) * 64);
+                    for (int bits = glyph[dy], px = sx; bits; bits >>= 1, ++px)
+                    {
+                        if (bits & 1)
+                        {
+                            uint8_t &dst = line[px / 2];
+                            dst = (px & 1) ? (dst & 0x0f) | (c << 4)
+                                           : (dst & 0xf0) | c;
+                        }
+                    }
                 }
+            }
+            else
+            {
+                for (int dy = 0; dy < h - 1; ++dy)
+                    for (int bits = glyph[dy], dx = 0; bits; bits >>= 1, ++dx)
+                        if (bits & 1)
+                            that->setpixel(x + dx, y + dy, c);
+            }
 
             x += w;
         }
     }
 
-    that->m_font.Unlock(pixels);
-
     // In PICO-8 scrolling only happens _after_ the whole string was printed,
     // even if it contained carriage returns or if the cursor was already
     // below the threshold value.
@@ -212,6 +506,7 @@ int vm::api::print(lua_State *l)
             int const lines = 6;
             memmove(screen, screen + lines * 64, SIZE_SCREEN - lines * 64);
             ::memset(screen + SIZE_SCREEN - lines * 64, 0, lines * 64);
+            that->dirty(0, 127);
             y -= lines;
         }
 
@@ -240,30 +535,10 @@ int vm::api::circ(lua_State *l)
     int y = lua_toclamp64(l, 2);
     int r = lua_toclamp64(l, 3);
     if (!lua_isnone(l, 4))
-        that->m_color = (int)lua_toclamp64(l, 4) & 0xf;
-    int c = that->m_pal[0][that->m_color];
+        that->m_color = (int)lua_toclamp64(l, 4) & 0xff;
+    int c = that->fill_color();
 
-    for (int dx = r, dy = 0, err = 0; dx >= dy; )
-    {
-        that->setpixel(x + dx, y + dy, c);
-        that->setpixel(x + dy, y + dx, c);
-        that->setpixel(x - dy, y + dx, c);
-        that->setpixel(x - dx, y + dy, c);
-        that->setpixel(x - dx, y - dy, c);
-        that->setpixel(x - dy, y - dx, c);
-        that->setpixel(x + dy, y - dx, c);
-        that->setpixel(x + dx, y - dy, c);
-
-        dy += 1;
-        err += 1 + 2 * dy;
-        // XXX: original Bresenham has a different test, but
-        // this one seems to match PICO-8 better.
-        if (2 * (err - dx) > r + 1)
-        {
-            dx -= 1;
-            err += 1 - 2 * dx;
-        }
-    }
+    that->circle(x, y, r, false, c);
 
     return 0;
 }
@@ -276,27 +551,10 @@ int vm::api::circfill(lua_State *l)
     int y = lua_toclamp64(l, 2);
     int r = lua_toclamp64(l, 3);
     if (!lua_isnone(l, 4))
-        that->m_color = (int)lua_toclamp64(l, 4) & 0xf;
-    int c = that->m_pal[0][that->m_color];
+        that->m_color = (int)lua_toclamp64(l, 4) & 0xff;
+    int c = that->fill_color();
 
-    for (int dx = r, dy = 0, err = 0; dx >= dy; )
-    {
-        /* Some minor overdraw here, but nothing serious */
-        that->hline(x - dx, x + dx, y - dy, c);
-        that->hline(x - dx, x + dx, y + dy, c);
-        that->vline(x - dy, y - dx, y + dx, c);
-        that->vline(x + dy, y - dx, y + dx, c);
-
-        dy += 1;
-        err += 1 + 2 * dy;
-        // XXX: original Bresenham has a different test, but
-        // this one seems to match PICO-8 better.
-        if (2 * (err - dx) > r + 1)
-        {
-            dx -= 1;
-            err += 1 - 2 * dx;
-        }
-    }
+    that->circle(x, y, r, true, c);
 
     return 0;
 }
@@ -331,6 +589,8 @@ int vm::api::cls(lua_State *l)
     int c = lua_toclamp64(l, 1);
     vm *that = get_this(l);
     ::memset(&that->m_memory[OFFSET_SCREEN], (c & 0xf) * 0x11, SIZE_SCREEN);
+    that->dirty(0, 127);
+    that->charge(128 * 128 * (double)that->m_costs.fill_pixel);
     that->m_cursor = lol::ivec2(0, 0);
     return 0;
 }
@@ -338,7 +598,7 @@ int vm::api::cls(lua_State *l)
 int vm::api::color(lua_State *l)
 {
     vm *that = get_this(l);
-    that->m_color = (int)lua_toclamp64(l, 1) & 0xf;
+    that->m_color = (int)lua_toclamp64(l, 1) & 0xff;
     return 0;
 }
 
@@ -364,6 +624,19 @@ int vm::api::fget(lua_State *l)
     return 1;
 }
 
+int vm::api::fillp(lua_State *l)
+{
+    vm *that = get_this(l);
+
+    // The 16 integer bits are the 4×4 pattern, and the 0.5 bit tells
+    // whether set bits are transparent or use the secondary colour.
+    int32_t fixed = double2fixed(lua_toclamp64(l, 1));
+    that->m_fillp = (uint16_t)(fixed >> 16);
+    that->m_fillp_trans = (fixed & 0x8000) != 0;
+
+    return 0;
+}
+
 int vm::api::fset(lua_State *l)
 {
     if (lua_isnone(l, 1) || lua_isnone(l, 2))
@@ -399,19 +672,19 @@ int vm::api::line(lua_State *l)
     int x1 = lua_toclamp64(l, 3);
     int y1 = lua_toclamp64(l, 4);
     if (!lua_isnone(l, 5))
-        that->m_color = (int)lua_toclamp64(l, 5) & 0xf;
-    int c = that->m_pal[0][that->m_color];
+        that->m_color = (int)lua_toclamp64(l, 5) & 0xff;
+    int c = that->fill_color();
 
     if (x0 == x1 && y0 == y1)
     {
-        that->setpixel(x0, y0, c);
+        that->plot(x0, y0, c);
     }
     else if (lol::abs(x1 - x0) > lol::abs(y1 - y0))
     {
         for (int x = lol::min(x0, x1); x <= lol::max(x0, x1); ++x)
         {
             int y = lol::round(lol::mix((float)y0, (float)y1, (float)(x - x0) / (x1 - x0)));
-            that->setpixel(x, y, c);
+            that->plot(x, y, c);
         }
     }
     else
@@ -419,7 +692,7 @@ int vm::api::line(lua_State *l)
         for (int y = lol::min(y0, y1); y <= lol::max(y0, y1); ++y)
         {
             int x = lol::round(lol::mix((float)x0, (float)x1, (float)(y - y0) / (y1 - y0)));
-            that->setpixel(x, y, c);
+            that->plot(x, y, c);
         }
     }
 
@@ -437,6 +710,8 @@ int vm::api::map(lua_State *l)
     int layer = lua_toclamp64(l, 7);
 
     vm *that = get_this(l);
+    that->charge((double)that->clipped_area(sx, sy, cel_w * 8, cel_h * 8)
+                  * that->m_costs.sprite_pixel);
 
     for (int dy = 0; dy < cel_h * 8; ++dy)
     for (int dx = 0; dx < cel_w * 8; ++dx)
@@ -503,6 +778,40 @@ int vm::api::mset(lua_State *l)
     return 0;
 }
 
+int vm::api::oval(lua_State *l)
+{
+    vm *that = get_this(l);
+
+    int x0 = lua_toclamp64(l, 1);
+    int y0 = lua_toclamp64(l, 2);
+    int x1 = lua_toclamp64(l, 3);
+    int y1 = lua_toclamp64(l, 4);
+    if (!lua_isnone(l, 5))
+        that->m_color = (int)lua_toclamp64(l, 5) & 0xff;
+    int c = that->fill_color();
+
+    that->ellipse(x0, y0, x1, y1, false, c);
+
+    return 0;
+}
+
+int vm::api::ovalfill(lua_State *l)
+{
+    vm *that = get_this(l);
+
+    int x0 = lua_toclamp64(l, 1);
+    int y0 = lua_toclamp64(l, 2);
+    int x1 = lua_toclamp64(l, 3);
+    int y1 = lua_toclamp64(l, 4);
+    if (!lua_isnone(l, 5))
+        that->m_color = (int)lua_toclamp64(l, 5) & 0xff;
+    int c = that->fill_color();
+
+    that->ellipse(x0, y0, x1, y1, true, c);
+
+    return 0;
+}
+
 int vm::api::pal(lua_State *l)
 {
     vm *that = get_this(l);
@@ -514,6 +823,9 @@ int vm::api::pal(lua_State *l)
             that->m_pal[0][i] = that->m_pal[1][i] = i;
             that->m_palt[i] = i ? 0 : 1;
         }
+
+        // The display palette affects every row
+        that->dirty(0, 127);
     }
     else
     {
@@ -522,6 +834,8 @@ int vm::api::pal(lua_State *l)
         int p = lua_toclamp64(l, 3);
 
         that->m_pal[p & 1][c0 & 0xf] = c1 & 0xf;
+        if (p & 1)
+            that->dirty(0, 127);
     }
 
     return 0;
@@ -558,6 +872,33 @@ int vm::api::pget(lua_State *l)
     return 1;
 }
 
+int vm::api::polyfill(lua_State *l)
+{
+    vm *that = get_this(l);
+
+    if (!lua_istable(l, 1))
+        return 0;
+
+    // Vertices are given as a flat {x0, y0, x1, y1, ...} table
+    int count = (int)lua_rawlen(l, 1) / 2;
+    lol::array<double> coords;
+    coords.resize(2 * count);
+    for (int i = 0; i < 2 * count; ++i)
+    {
+        lua_rawgeti(l, 1, i + 1);
+        coords[i] = lua_toclamp64(l, -1);
+        lua_pop(l, 1);
+    }
+
+    if (!lua_isnone(l, 2))
+        that->m_color = (int)lua_toclamp64(l, 2) & 0xff;
+    int c = that->fill_color();
+
+    that->polygon(coords.data(), count, c);
+
+    return 0;
+}
+
 int vm::api::pset(lua_State *l)
 {
     vm *that = get_this(l);
@@ -565,10 +906,10 @@ int vm::api::pset(lua_State *l)
     int x = lua_toclamp64(l, 1);
     int y = lua_toclamp64(l, 2);
     if (!lua_isnone(l, 3))
-        that->m_color = (int)lua_toclamp64(l, 3) & 0xf;
-    int c = that->m_pal[0][that->m_color];
+        that->m_color = (int)lua_toclamp64(l, 3) & 0xff;
+    int c = that->fill_color();
 
-    that->setpixel(x, y, c);
+    that->plot(x, y, c);
 
     return 0;
 }
@@ -582,8 +923,8 @@ int vm::api::rect(lua_State *l)
     int x1 = lua_toclamp64(l, 3);
     int y1 = lua_toclamp64(l, 4);
     if (!lua_isnone(l, 5))
-        that->m_color = (int)lua_toclamp64(l, 5) & 0xf;
-    int c = that->m_pal[0][that->m_color];
+        that->m_color = (int)lua_toclamp64(l, 5) & 0xff;
+    int c = that->fill_color();
 
     if (x0 > x1)
         std::swap(x0, x1);
@@ -612,8 +953,12 @@ int vm::api::rectfill(lua_State *l)
     int x1 = lua_toclamp64(l, 3);
     int y1 = lua_toclamp64(l, 4);
     if (!lua_isnone(l, 5))
-        that->m_color = (int)lua_toclamp64(l, 5) & 0xf;
-    int c = that->m_pal[0][that->m_color];
+        that->m_color = (int)lua_toclamp64(l, 5) & 0xff;
+    int c = that->fill_color();
+
+    that->charge((double)that->clipped_area(lol::min(x0, x1), lol::min(y0, y1),
+                                            lol::abs(x1 - x0) + 1, lol::abs(y1 - y0) + 1)
+                  * that->m_costs.fill_pixel);
 
     for (int y = lol::min(y0, y1); y <= lol::max(y0, y1); ++y)
         that->hline(lol::min(x0, x1), lol::max(x0, x1), y, c);
@@ -660,6 +1005,9 @@ int vm::api::spr(lua_State *l)
     int flip_x = lua_toboolean(l, 6);
     int flip_y = lua_toboolean(l, 7);
 
+    that->charge((double)that->clipped_area(x, y, (int)(w * 8), (int)(h * 8))
+                  * that->m_costs.sprite_pixel);
+
     for (int j = 0; j < h * 8; ++j)
         for (int i = 0; i < w * 8; ++i)
         {
@@ -691,6 +1039,9 @@ int vm::api::sspr(lua_State *l)
     int flip_x = lua_toboolean(l, 9);
     int flip_y = lua_toboolean(l, 10);
 
+    that->charge((double)that->clipped_area(dx, dy, dw, dh)
+                  * that->m_costs.sprite_pixel);
+
     // Iterate over destination pixels
     for (int j = 0; j < dh; ++j)
     for (int i = 0; i < dw; ++i)
@@ -713,5 +1064,76 @@ int vm::api::sspr(lua_State *l)
     return 0;
 }
 
+int vm::api::tline(lua_State *l)
+{
+    vm *that = get_this(l);
+
+    int x0 = lua_toclamp64(l, 1);
+    int y0 = lua_toclamp64(l, 2);
+    int x1 = lua_toclamp64(l, 3);
+    int y1 = lua_toclamp64(l, 4);
+
+    // Map coordinates are in cells, stored as 16:16 fixed point values;
+    // by default, advance one sprite pixel to the right per screen pixel.
+    int32_t mx = double2fixed(lua_toclamp64(l, 5));
+    int32_t my = double2fixed(lua_toclamp64(l, 6));
+    int32_t mdx = lua_isnone(l, 7) ? 0x2000 : double2fixed(lua_toclamp64(l, 7));
+    int32_t mdy = lua_isnone(l, 8) ? 0 : double2fixed(lua_toclamp64(l, 8));
+
+    // Walk the line from (x0,y0) to (x1,y1) one pixel at a time along
+    // its major axis, in that order, since texture coordinates depend
+    // on the pixel index.
+    int64_t dx = x1 - x0, dy = y1 - y0;
+    int steps = (int)lol::max(lol::abs(dx), lol::abs(dy));
+    int64_t x = x0 * 0x10000ll + 0x8000, y = y0 * 0x10000ll + 0x8000;
+    int64_t sx = steps ? dx * 0x10000 / steps : 0;
+    int64_t sy = steps ? dy * 0x10000 / steps : 0;
+
+    for (int i = 0; i <= steps; ++i)
+    {
+        int cx = mx >> 16, cy = my >> 16;
+        if (cx >= 0 && cx < 128 && cy >= 0 && cy < 64)
+        {
+            int line = cy < 32 ? OFFSET_MAP + 128 * cy
+                               : OFFSET_MAP2 + 128 * (cy - 32);
+            int sprite = that->m_memory[line + cx];
+
+            if (sprite)
+            {
+                int col = that->getspixel(sprite % 16 * 8 + ((mx >> 13) & 7),
+                                          sprite / 16 * 8 + ((my >> 13) & 7));
+                if (!that->m_palt[col])
+                {
+                    int c = that->m_pal[0][col & 0xf];
+                    that->setpixel((int)(x >> 16), (int)(y >> 16), c);
+                }
+            }
+        }
+
+        x += sx;
+        y += sy;
+        mx += mdx;
+        my += mdy;
+    }
+
+    return 0;
+}
+
+int vm::api::trifill(lua_State *l)
+{
+    vm *that = get_this(l);
+
+    double coords[6];
+    for (int i = 0; i < 6; ++i)
+        coords[i] = lua_toclamp64(l, i + 1);
+    if (!lua_isnone(l, 7))
+        that->m_color = (int)lua_toclamp64(l, 7) & 0xff;
+    int c = that->fill_color();
+
+    that->polygon(coords, 3, c);
+
+    return 0;
+}
+
 } // namespace z8
 
@@ -12,6 +12,13 @@
 
 #include <lol/engine.h>
 
+// The SSSE3 path is always built on x86 with GCC or Clang, and chosen
+// at runtime when the CPU supports it
+#if (defined __x86_64__ || defined __i386__) && defined __GNUC__
+#   define Z8_SSSE3 1
+#   include <tmmintrin.h>
+#endif
+
 #include "vm.h"
 
 namespace z8
@@ -21,87 +28,174 @@ using lol::msg;
 
 void vm::render(lol::u8vec4 *screen) const
 {
-    for (int n = 0; n < 128 * 128 / 2; ++n)
-    {
-        uint8_t data = m_memory[OFFSET_SCREEN + n];
-        screen[2 * n] = palette::get(m_pal[1][data & 0xf]);
-        screen[2 * n + 1] = palette::get(m_pal[1][data >> 4]);
-    }
+    render(screen, 128 * sizeof(lol::u8vec4), pixel_format::rgba);
 }
 
-void vm::print_ansi(lol::ivec2 term_size,
-                    uint8_t const *prev_screen) const
+void vm::update_lut(pixel_format format) const
 {
-    static int const ansi_palette[] =
+    if (m_lut_format == (int)format && !memcmp(m_lut_pal, m_pal[1], 16))
+        return;
+
+    m_lut_format = (int)format;
+    ::memcpy(m_lut_pal, m_pal[1], 16);
+
+    // Output bytes for each of the 16 colours
+    uint8_t colors[16][4];
+    for (int i = 0; i < 16; ++i)
     {
-         16, // 000000 → 000000
-         17, // 1d2b53 → 00005f
-         89, // 7e2553 → 87005f
-         29, // 008751 → 00875f
-        131, // ab5236 → ab5236
-        240, // 5f574f → 5f5f5f
-        251, // c2c3c7 → c6c6c6
-        230, // fff1e8 → ffffdf
-        197, // ff004d → ff005f
-        214, // ffa300 → ffaf00
-        220, // ffec27 → ffdf00
-         47, // 00e436 → 00ff5f
-         39, // 29adff → 00afff
-        103, // 83769c → 8787af
-        211, // ff77a8 → f787af
-        223, // ffccaa → ffdfaf
-    };
-
-    printf("\x1b[?25l"); // hide cursor
-
-    for (int y = 0; y < 2 * lol::min(64, term_size.y); y += 2)
+        lol::u8vec4 c = palette::get(m_pal[1][i]);
+
+        switch (format)
+        {
+        case pixel_format::rgba:
+            colors[i][0] = c.r; colors[i][1] = c.g;
+            colors[i][2] = c.b; colors[i][3] = c.a;
+            break;
+        case pixel_format::bgra:
+            colors[i][0] = c.b; colors[i][1] = c.g;
+            colors[i][2] = c.r; colors[i][3] = c.a;
+            break;
+        case pixel_format::rgb565:
+        {
+            uint16_t p = ((c.r >> 3) << 11) | ((c.g >> 2) << 5) | (c.b >> 3);
+            ::memcpy(colors[i], &p, sizeof(p));
+            break;
+        }
+        case pixel_format::indexed:
+            colors[i][0] = m_pal[1][i];
+            break;
+        case pixel_format::yuv420:
+            // Only luma goes through the table (BT.601, studio range)
+            colors[i][0] = (uint8_t)((66 * c.r + 129 * c.g + 25 * c.b + 128) / 256 + 16);
+            break;
+        }
+    }
+
+    int bpp = format == pixel_format::rgba || format == pixel_format::bgra ? 4
+            : format == pixel_format::rgb565 ? 2 : 1;
+
+    for (int n = 0; n < 256; ++n)
     {
-        if (prev_screen && !memcmp(get_mem(OFFSET_SCREEN + y * 64),
-                                   prev_screen + y * 64, 128))
-            continue;
+        ::memcpy(m_lut[n], colors[n & 0xf], bpp);
+        ::memcpy(m_lut[n] + bpp, colors[n >> 4], bpp);
+    }
+}
 
-        printf("\x1b[%d;1H", y / 2 + 1);
+#if Z8_SSSE3
+// Expand 16 pixels (8 bytes of screen memory) to 32-bit pixels using
+// one pshufb per channel; tables hold each channel of the 16 colours.
+__attribute__((target("ssse3")))
+static inline void expand_ssse3(uint8_t *dst, uint8_t const *src,
+                                __m128i const *tables)
+{
+    __m128i data = _mm_loadl_epi64((__m128i const *)src);
+    __m128i lo = _mm_and_si128(data, _mm_set1_epi8(0x0f));
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(data, 4), _mm_set1_epi8(0x0f));
+    __m128i idx = _mm_unpacklo_epi8(lo, hi);
+
+    __m128i c0 = _mm_shuffle_epi8(tables[0], idx);
+    __m128i c1 = _mm_shuffle_epi8(tables[1], idx);
+    __m128i c2 = _mm_shuffle_epi8(tables[2], idx);
+    __m128i c3 = _mm_shuffle_epi8(tables[3], idx);
+
+    __m128i c01l = _mm_unpacklo_epi8(c0, c1), c01h = _mm_unpackhi_epi8(c0, c1);
+    __m128i c23l = _mm_unpacklo_epi8(c2, c3), c23h = _mm_unpackhi_epi8(c2, c3);
+
+    _mm_storeu_si128((__m128i *)dst + 0, _mm_unpacklo_epi16(c01l, c23l));
+    _mm_storeu_si128((__m128i *)dst + 1, _mm_unpackhi_epi16(c01l, c23l));
+    _mm_storeu_si128((__m128i *)dst + 2, _mm_unpacklo_epi16(c01h, c23h));
+    _mm_storeu_si128((__m128i *)dst + 3, _mm_unpackhi_epi16(c01h, c23h));
+}
 
-        int oldfg = -1, oldbg = -1;
+__attribute__((target("ssse3")))
+static void render_ssse3(uint8_t *dst, int stride, uint8_t const *screen,
+                         uint8_t const (*lut)[8])
+{
+    // Rebuild per-channel tables from the LUT (low nibble half)
+    uint8_t channels[4][16];
+    for (int i = 0; i < 16; ++i)
+        for (int ch = 0; ch < 4; ++ch)
+            channels[ch][i] = lut[i][ch];
+
+    __m128i tables[4];
+    for (int ch = 0; ch < 4; ++ch)
+        tables[ch] = _mm_loadu_si128((__m128i const *)channels[ch]);
+
+    for (int y = 0; y < 128; ++y, dst += stride, screen += 64)
+        for (int x = 0; x < 64; x += 8)
+            expand_ssse3(dst + 8 * x, screen + x, tables);
+}
 
-        for (int x = 0; x < lol::min(128, term_size.x); ++x)
+static bool has_ssse3()
+{
+    static bool const ret = __builtin_cpu_supports("ssse3");
+    return ret;
+}
+#endif
+
+void vm::render(void *buffer, int stride, pixel_format format) const
+{
+    update_lut(format);
+
+    uint8_t const *screen = get_mem(OFFSET_SCREEN);
+    uint8_t *dst = (uint8_t *)buffer;
+
+    if (format == pixel_format::rgba || format == pixel_format::bgra)
+    {
+#if Z8_SSSE3
+        if (has_ssse3())
+        {
+            render_ssse3(dst, stride, screen, m_lut);
+            return;
+        }
+#endif
+        for (int y = 0; y < 128; ++y, dst += stride, screen += 64)
+            for (int x = 0; x < 64; ++x)
+                ::memcpy(dst + 8 * x, m_lut[screen[x]], 8);
+    }
+    else if (format == pixel_format::rgb565)
+    {
+        for (int y = 0; y < 128; ++y, dst += stride, screen += 64)
+            for (int x = 0; x < 64; ++x)
+                ::memcpy(dst + 4 * x, m_lut[screen[x]], 4);
+    }
+    else if (format == pixel_format::indexed)
+    {
+        for (int y = 0; y < 128; ++y, dst += stride, screen += 64)
+            for (int x = 0; x < 64; ++x)
+                ::memcpy(dst + 2 * x, m_lut[screen[x]], 2);
+    }
+    else if (format == pixel_format::yuv420)
+    {
+        // Chroma of each colour, averaged over 2×2 blocks below
+        int u[16], v[16];
+        for (int i = 0; i < 16; ++i)
         {
-            int offset = y * 64 + x / 2;
-            int shift = 4 * (x & 1);
-            uint8_t fg = (m_memory[OFFSET_SCREEN + offset] >> shift) & 0xf;
-            uint8_t bg = (m_memory[OFFSET_SCREEN + offset + 64] >> shift) & 0xf;
-            char const *glyph = "▀";
+            lol::u8vec4 c = palette::get(m_pal[1][i]);
+            u[i] = (-38 * c.r - 74 * c.g + 112 * c.b + 128) / 256 + 128;
+            v[i] = (112 * c.r - 94 * c.g - 18 * c.b + 128) / 256 + 128;
+        }
 
-            if (fg < bg)
-            {
-                std::swap(fg, bg);
-                glyph = "▄";
-            }
+        // U and V planes follow the Y plane, with half its stride
+        uint8_t *uplane = dst + 128 * stride;
+        uint8_t *vplane = uplane + 64 * (stride / 2);
 
-            if (fg == oldfg)
-            {
-                if (bg != oldbg)
-                    printf("\x1b[48;5;%dm", ansi_palette[m_pal[1][bg]]);
-            }
-            else
+        for (int y = 0; y < 128; ++y, dst += stride, screen += 64)
+            for (int x = 0; x < 64; ++x)
+                ::memcpy(dst + 2 * x, m_lut[screen[x]], 2);
+
+        screen = get_mem(OFFSET_SCREEN);
+        for (int y = 0; y < 64; ++y, screen += 128)
+        {
+            for (int x = 0; x < 64; ++x)
             {
-                if (bg == oldbg)
-                    printf("\x1b[38;5;%dm", ansi_palette[m_pal[1][fg]]);
-                else
-                    printf("\x1b[38;5;%d;48;5;%dm", ansi_palette[m_pal[1][fg]], ansi_palette[m_pal[1][bg]]);
+                uint8_t a = screen[x], b = screen[x + 64];
+                int i0 = a & 0xf, i1 = a >> 4, i2 = b & 0xf, i3 = b >> 4;
+                uplane[y * (stride / 2) + x] = (u[i0] + u[i1] + u[i2] + u[i3] + 2) / 4;
+                vplane[y * (stride / 2) + x] = (v[i0] + v[i1] + v[i2] + v[i3] + 2) / 4;
             }
-
-            printf(glyph);
-
-            oldfg = fg;
-            oldbg = bg;
         }
-
-        printf("\x1b[0m\x1b[K"); // reset properties and clear to end of line
     }
-
-    printf("\x1b[?25h"); // show cursor
-    fflush(stdout);
 }
 
 } // namespace z8
@@ -84,6 +84,14 @@ struct sfx
 static_assert(sizeof(sfx) == 68, "z8::sfx has incorrect size");
 
 
+bool vm::is_silent() const
+{
+    for (int chan = 0; chan < 4; ++chan)
+        if (m_channels[chan].m_sfx != -1)
+            return false;
+    return true;
+}
+
 vm::channel::channel()
   : m_sfx(-1),
     m_offset(0),
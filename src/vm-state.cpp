@@ -0,0 +1,833 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#include <lol/engine.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "vm.h"
+
+namespace z8
+{
+
+using lol::msg;
+
+//
+// Saved state format: a header, the memory as patches against the cart
+// ROM, the raw draw and audio state, then the Lua globals that differ
+// from a freshly initialised VM, as a stream of tagged values.
+//
+
+static char const state_magic[4] = { 'z', '8', 's', '1' };
+
+// Registry keys for the globals of a freshly initialised VM, and for its
+// C functions by name, such as “print” or “string.sub”
+static char const *pristine_key = "z8.pristine";
+static char const *cfunctions_key = "z8.cfunctions";
+
+enum : uint8_t
+{
+    tag_nil,
+    tag_false,
+    tag_true,
+    tag_integer,
+    tag_number,
+    tag_string,
+    tag_table,     // new table: entries, tag_end, then metatable
+    tag_globals,   // the globals table
+    tag_ref,       // table or function seen before, by index
+    tag_function,  // new Lua function: prototype, then upvalues
+    tag_cfunction, // C function without upvalues, by name
+    tag_pristine,  // value of a global in a fresh VM, by name
+    tag_end,
+};
+
+class state_writer
+{
+public:
+    state_writer(lol::array<uint8_t> &out)
+      : m_out(out)
+    {}
+
+    void put(void const *data, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+            m_out << ((uint8_t const *)data)[i];
+    }
+
+    void put8(uint8_t x) { m_out << x; }
+    void put32(uint32_t x) { put(&x, sizeof(x)); }
+
+    // Append the value at the given stack index, or return false if it
+    // or anything it references cannot be saved
+    bool value(lua_State *l, int index);
+
+    // Tables and functions that a fresh VM has as globals, such as the
+    // API functions, are saved by name; so are the C functions it has
+    std::unordered_map<void const *, std::string> m_pristine;
+    std::unordered_map<void const *, std::string> m_cfunctions;
+
+    // What could not be saved
+    char const *m_error = nullptr;
+
+private:
+    static int dump(lua_State *l, void const *data, size_t size, void *ud)
+    {
+        UNUSED(l);
+        ((std::string *)ud)->append((char const *)data, size);
+        return 0;
+    }
+
+    bool fail(char const *error)
+    {
+        m_error = error;
+        return false;
+    }
+
+    lol::array<uint8_t> &m_out;
+
+    // Tables and functions, bytecode and upvalues already written, with
+    // the index the reader will know them by
+    std::unordered_map<void const *, uint32_t> m_objects;
+    std::unordered_map<std::string, uint32_t> m_protos;
+    std::unordered_map<void *, uint32_t> m_upvalues;
+};
+
+bool state_writer::value(lua_State *l, int index)
+{
+    index = lua_absindex(l, index);
+    if (!lua_checkstack(l, 4))
+        return fail("values nested too deeply");
+
+    switch (lua_type(l, index))
+    {
+    case LUA_TNIL:
+        put8(tag_nil);
+        return true;
+    case LUA_TBOOLEAN:
+        put8(lua_toboolean(l, index) ? tag_true : tag_false);
+        return true;
+    case LUA_TNUMBER:
+        if (lua_isinteger(l, index))
+        {
+            lua_Integer x = lua_tointeger(l, index);
+            put8(tag_integer);
+            put(&x, sizeof(x));
+        }
+        else
+        {
+            lua_Number x = lua_tonumber(l, index);
+            put8(tag_number);
+            put(&x, sizeof(x));
+        }
+        return true;
+    case LUA_TSTRING:
+    {
+        size_t len;
+        char const *str = lua_tolstring(l, index, &len);
+        put8(tag_string);
+        put32((uint32_t)len);
+        put(str, len);
+        return true;
+    }
+    case LUA_TTABLE:
+    case LUA_TFUNCTION:
+        break;
+    case LUA_TTHREAD:
+        // Coroutines and userdata hold state we cannot reach
+        return fail("coroutine");
+    default:
+        return fail("userdata");
+    }
+
+    lua_pushglobaltable(l);
+    bool is_globals = lua_rawequal(l, -1, index);
+    lua_pop(l, 1);
+    if (is_globals)
+    {
+        put8(tag_globals);
+        return true;
+    }
+
+    void const *p = lua_topointer(l, index);
+    auto name = m_pristine.find(p);
+    if (name != m_pristine.end())
+    {
+        put8(tag_pristine);
+        put32((uint32_t)name->second.size());
+        put(name->second.data(), name->second.size());
+        return true;
+    }
+
+    auto it = m_objects.find(p);
+    if (it != m_objects.end())
+    {
+        put8(tag_ref);
+        put32(it->second);
+        return true;
+    }
+
+    // C functions are saved by the name they have in a fresh VM, which
+    // restore() checks, so a blob can never call an arbitrary address
+    if (lua_iscfunction(l, index))
+    {
+        if (lua_getupvalue(l, index, 1))
+        {
+            lua_pop(l, 1);
+            return fail("C closure");
+        }
+        auto cname = m_cfunctions.find(p);
+        if (cname == m_cfunctions.end())
+            return fail("unknown C function");
+        m_objects[p] = (uint32_t)m_objects.size();
+        put8(tag_cfunction);
+        put32((uint32_t)cname->second.size());
+        put(cname->second.data(), cname->second.size());
+        return true;
+    }
+
+    // Register the object before its contents, for cycles
+    m_objects[p] = (uint32_t)m_objects.size();
+
+    if (lua_istable(l, index))
+    {
+        put8(tag_table);
+        lua_pushnil(l);
+        while (lua_next(l, index))
+        {
+            if (!value(l, -2) || !value(l, -1))
+            {
+                lua_pop(l, 2);
+                return false;
+            }
+            lua_pop(l, 1);
+        }
+        put8(tag_end);
+
+        if (!lua_getmetatable(l, index))
+        {
+            put8(tag_nil);
+            return true;
+        }
+        bool ret = value(l, -1);
+        lua_pop(l, 1);
+        return ret;
+    }
+
+    // Lua function: identical bytecode is only stored once
+    std::string code;
+    lua_pushvalue(l, index);
+    lua_dump(l, &state_writer::dump, &code, 0);
+    lua_pop(l, 1);
+
+    put8(tag_function);
+    auto proto = m_protos.find(code);
+    if (proto != m_protos.end())
+    {
+        put32(proto->second);
+    }
+    else
+    {
+        uint32_t n = (uint32_t)m_protos.size();
+        m_protos[code] = n;
+        put32(n);
+        put32((uint32_t)code.size());
+        put(code.data(), code.size());
+    }
+
+    // Upvalues shared between closures are written once, and the later
+    // closures only refer to them so that the reader can join them
+    int count = 0;
+    while (lua_getupvalue(l, index, count + 1))
+    {
+        lua_pop(l, 1);
+        ++count;
+    }
+    put8((uint8_t)count);
+
+    for (int n = 1; n <= count; ++n)
+    {
+        void *id = lua_upvalueid(l, index, n);
+        auto up = m_upvalues.find(id);
+        if (up != m_upvalues.end())
+        {
+            put8(0);
+            put32(up->second);
+            continue;
+        }
+
+        m_upvalues[id] = (uint32_t)m_upvalues.size();
+        put8(1);
+        lua_getupvalue(l, index, n);
+        bool ret = value(l, -1);
+        lua_pop(l, 1);
+        if (!ret)
+            return false;
+    }
+
+    return true;
+}
+
+class state_reader
+{
+public:
+    state_reader(uint8_t const *data, size_t size)
+      : m_objects(0),
+        m_data(data),
+        m_size(size),
+        m_pos(0)
+    {}
+
+    bool get(void *data, size_t size)
+    {
+        if (m_size - m_pos < size)
+            return false;
+        ::memcpy(data, m_data + m_pos, size);
+        m_pos += size;
+        return true;
+    }
+
+    bool get8(uint8_t &x) { return get(&x, sizeof(x)); }
+    bool get32(uint32_t &x) { return get(&x, sizeof(x)); }
+
+    // Consume the end tag if it is next
+    bool end()
+    {
+        if (m_pos >= m_size || m_data[m_pos] != tag_end)
+            return false;
+        ++m_pos;
+        return true;
+    }
+
+    // Push the next value on the stack, or return false and push nothing
+    // if the data is corrupted; objects are tracked in the table at the
+    // stack index given by m_objects.
+    bool value(lua_State *l);
+
+    int m_objects;
+
+private:
+    uint8_t const *m_data;
+    size_t m_size, m_pos;
+
+    uint32_t m_count = 0;
+    std::vector<std::string> m_protos;
+
+    // For each upvalue, the object index and upvalue number of the
+    // closure that owns it
+    std::vector<std::pair<uint32_t, int>> m_upvalues;
+};
+
+bool state_reader::value(lua_State *l)
+{
+    uint8_t tag;
+    if (!get8(tag) || !lua_checkstack(l, 4))
+        return false;
+
+    switch (tag)
+    {
+    case tag_nil:
+        lua_pushnil(l);
+        return true;
+    case tag_false:
+    case tag_true:
+        lua_pushboolean(l, tag == tag_true);
+        return true;
+    case tag_integer:
+    {
+        lua_Integer x;
+        if (!get(&x, sizeof(x)))
+            return false;
+        lua_pushinteger(l, x);
+        return true;
+    }
+    case tag_number:
+    {
+        lua_Number x;
+        if (!get(&x, sizeof(x)))
+            return false;
+        lua_pushnumber(l, x);
+        return true;
+    }
+    case tag_string:
+    {
+        uint32_t len;
+        if (!get32(len) || m_size - m_pos < len)
+            return false;
+        lua_pushlstring(l, (char const *)m_data + m_pos, len);
+        m_pos += len;
+        return true;
+    }
+    case tag_globals:
+        lua_pushglobaltable(l);
+        return true;
+    case tag_pristine:
+    {
+        uint32_t len;
+        if (!get32(len) || m_size - m_pos < len)
+            return false;
+        lua_getfield(l, LUA_REGISTRYINDEX, pristine_key);
+        lua_pushlstring(l, (char const *)m_data + m_pos, len);
+        m_pos += len;
+        lua_rawget(l, -2);
+        lua_remove(l, -2);
+        return true;
+    }
+    case tag_ref:
+    {
+        uint32_t id;
+        if (!get32(id) || id >= m_count)
+            return false;
+        lua_rawgeti(l, m_objects, id + 1);
+        return true;
+    }
+    case tag_cfunction:
+    {
+        uint32_t len;
+        if (!get32(len) || m_size - m_pos < len)
+            return false;
+        lua_getfield(l, LUA_REGISTRYINDEX, cfunctions_key);
+        lua_pushlstring(l, (char const *)m_data + m_pos, len);
+        lua_rawget(l, -2);
+        lua_remove(l, -2);
+        m_pos += len;
+        if (!lua_iscfunction(l, -1))
+        {
+            lua_pop(l, 1);
+            return false;
+        }
+        lua_pushvalue(l, -1);
+        lua_rawseti(l, m_objects, ++m_count);
+        return true;
+    }
+    case tag_table:
+    {
+        lua_newtable(l);
+        lua_pushvalue(l, -1);
+        lua_rawseti(l, m_objects, ++m_count);
+
+        while (!end())
+        {
+            if (!value(l))
+            {
+                lua_pop(l, 1);
+                return false;
+            }
+            if (lua_isnil(l, -1) || (lua_type(l, -1) == LUA_TNUMBER
+                                      && lua_tonumber(l, -1) != lua_tonumber(l, -1))
+                 || !value(l))
+            {
+                lua_pop(l, 2);
+                return false;
+            }
+            lua_rawset(l, -3);
+        }
+
+        if (!value(l))
+        {
+            lua_pop(l, 1);
+            return false;
+        }
+        if (lua_istable(l, -1))
+            lua_setmetatable(l, -2);
+        else
+            lua_pop(l, 1);
+        return true;
+    }
+    case tag_function:
+    {
+        uint32_t proto;
+        if (!get32(proto) || proto > m_protos.size())
+            return false;
+        if (proto == m_protos.size())
+        {
+            uint32_t len;
+            if (!get32(len) || m_size - m_pos < len)
+                return false;
+            m_protos.push_back(std::string((char const *)m_data + m_pos, len));
+            m_pos += len;
+        }
+
+        std::string const &code = m_protos[proto];
+        if (luaL_loadbufferx(l, code.data(), code.size(), "=cart", "b") != LUA_OK)
+        {
+            lua_pop(l, 1);
+            return false;
+        }
+        int index = lua_gettop(l);
+        uint32_t id = m_count;
+        lua_pushvalue(l, -1);
+        lua_rawseti(l, m_objects, ++m_count);
+
+        uint8_t count;
+        if (!get8(count))
+        {
+            lua_pop(l, 1);
+            return false;
+        }
+        for (int n = 1; n <= count; ++n)
+        {
+            uint8_t fresh;
+            uint32_t up;
+            if (!get8(fresh))
+            {
+                lua_settop(l, index - 1);
+                return false;
+            }
+
+            if (fresh)
+            {
+                m_upvalues.push_back(std::make_pair(id, n));
+                if (!value(l))
+                {
+                    lua_settop(l, index - 1);
+                    return false;
+                }
+                if (!lua_setupvalue(l, index, n))
+                    lua_pop(l, 1);
+            }
+            else if (get32(up) && up < m_upvalues.size())
+            {
+                lua_rawgeti(l, m_objects, m_upvalues[up].first + 1);
+                lua_upvaluejoin(l, index, n, -1, m_upvalues[up].second);
+                lua_pop(l, 1);
+            }
+            else
+            {
+                lua_settop(l, index - 1);
+                return false;
+            }
+        }
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// Run with the writer as light userdata; pushes whether it succeeded
+static int save_globals(lua_State *l)
+{
+    state_writer *w = (state_writer *)lua_touserdata(l, 1);
+
+    lua_getfield(l, LUA_REGISTRYINDEX, pristine_key);
+    lua_pushglobaltable(l);
+
+    lua_pushnil(l);
+    while (lua_next(l, 2))
+    {
+        if (lua_type(l, -2) == LUA_TSTRING
+             && (lua_istable(l, -1) || lua_isfunction(l, -1)))
+            w->m_pristine[lua_topointer(l, -1)] = lua_tostring(l, -2);
+        lua_pop(l, 1);
+    }
+
+    lua_getfield(l, LUA_REGISTRYINDEX, cfunctions_key);
+    lua_pushnil(l);
+    while (lua_next(l, -2))
+    {
+        w->m_cfunctions[lua_topointer(l, -1)] = lua_tostring(l, -2);
+        lua_pop(l, 1);
+    }
+    lua_pop(l, 1);
+
+    // Globals that the cart added or changed
+    lua_pushnil(l);
+    while (lua_next(l, 3))
+    {
+        lua_pushvalue(l, -2);
+        lua_rawget(l, 2);
+        bool same = lua_rawequal(l, -1, -2);
+        lua_pop(l, 1);
+        if (!same && (!w->value(l, -2) || !w->value(l, -1)))
+        {
+            lua_pushboolean(l, false);
+            return 1;
+        }
+        lua_pop(l, 1);
+    }
+    w->put8(tag_end);
+
+    // Globals that the cart removed
+    lua_pushnil(l);
+    while (lua_next(l, 2))
+    {
+        lua_pushvalue(l, -2);
+        lua_rawget(l, 3);
+        if (lua_isnil(l, -1) && !w->value(l, -3))
+        {
+            lua_pushboolean(l, false);
+            return 1;
+        }
+        lua_pop(l, 2);
+    }
+    w->put8(tag_end);
+
+    // Main loop state
+    lua_getfield(l, 3, "_z8");
+    lua_getfield(l, -1, "do_frame");
+    lua_pushboolean(l, w->value(l, -1));
+    return 1;
+}
+
+// Run with the reader as light userdata; pushes whether it succeeded
+static int restore_globals(lua_State *l)
+{
+    state_reader *r = (state_reader *)lua_touserdata(l, 1);
+
+    lua_newtable(l);
+    r->m_objects = lua_gettop(l);
+    lua_pushglobaltable(l);
+    int globals = lua_gettop(l);
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        while (!r->end())
+        {
+            if (!r->value(l))
+            {
+                lua_pushboolean(l, false);
+                return 1;
+            }
+
+            // First pass is key/value pairs, second pass is removed keys
+            if (pass == 0 && !r->value(l))
+            {
+                lua_pushboolean(l, false);
+                return 1;
+            }
+            if (pass == 1)
+                lua_pushnil(l);
+            if (lua_isnil(l, -2))
+            {
+                lua_pushboolean(l, false);
+                return 1;
+            }
+            lua_rawset(l, globals);
+        }
+    }
+
+    lua_getfield(l, globals, "_z8");
+    if (!r->value(l))
+    {
+        lua_pushboolean(l, false);
+        return 1;
+    }
+    lua_setfield(l, -2, "do_frame");
+    lua_pushboolean(l, false);
+    lua_setfield(l, -2, "at_yield");
+
+    // Create a new main loop coroutine
+    lua_getfield(l, -1, "resume");
+    lua_call(l, 0, 0);
+
+    lua_pushboolean(l, true);
+    return 1;
+}
+
+// Remember the globals of a freshly initialised VM, so that save() only
+// needs to store what the cart changed
+void vm::mark_pristine()
+{
+    lua_State *l = GetLuaState();
+
+    lua_newtable(l);
+    lua_pushglobaltable(l);
+    lua_pushnil(l);
+    while (lua_next(l, -2))
+    {
+        lua_pushvalue(l, -2);
+        lua_insert(l, -2);
+        lua_rawset(l, -5);
+    }
+    lua_pop(l, 1);
+    lua_setfield(l, LUA_REGISTRYINDEX, pristine_key);
+
+    // C functions reachable from the globals, one table deep
+    lua_newtable(l);
+    lua_pushglobaltable(l);
+    lua_pushnil(l);
+    while (lua_next(l, -2))
+    {
+        if (lua_type(l, -2) == LUA_TSTRING)
+        {
+            std::string name = lua_tostring(l, -2);
+            if (lua_iscfunction(l, -1))
+            {
+                lua_pushvalue(l, -1);
+                lua_setfield(l, -5, name.c_str());
+            }
+            else if (lua_istable(l, -1))
+            {
+                lua_pushnil(l);
+                while (lua_next(l, -2))
+                {
+                    if (lua_type(l, -2) == LUA_TSTRING && lua_iscfunction(l, -1))
+                        lua_setfield(l, -6, (name + "." + lua_tostring(l, -2)).c_str());
+                    else
+                        lua_pop(l, 1);
+                }
+            }
+        }
+        lua_pop(l, 1);
+    }
+    lua_pop(l, 1);
+    lua_setfield(l, LUA_REGISTRYINDEX, cfunctions_key);
+}
+
+char const *const vm::save_busy = "in the middle of a frame";
+
+bool vm::save(lol::array<uint8_t> &blob)
+{
+    lua_State *l = GetLuaState();
+
+    // Only save between two frames: the main loop coroutine cannot be
+    // saved, but at that point restore() can create a new one.
+    lua_getglobal(l, "_z8");
+    lua_getfield(l, -1, "at_yield");
+    bool at_yield = lua_toboolean(l, -1);
+    lua_pop(l, 2);
+    if (!at_yield)
+    {
+        m_save_error = save_busy;
+        return false;
+    }
+
+    blob.empty();
+    state_writer w(blob);
+    w.put(state_magic, sizeof(state_magic));
+
+    // Memory, as runs of bytes that differ from what reload() would put
+    // there; runs closer than 8 bytes are merged
+    lol::array<uint8_t> const &rom = m_cart->get_rom();
+    int rom_size = lol::min(rom.count(), (int)OFFSET_CODE);
+    auto ref = [&](int i) { return i < rom_size ? rom[i] : 0; };
+
+    for (int i = 0; i < SIZE_MEMORY; )
+    {
+        if (m_memory[i] == ref(i))
+        {
+            ++i;
+            continue;
+        }
+
+        int start = i, gap = 0;
+        for ( ; i < SIZE_MEMORY && gap < 8; ++i)
+            gap = m_memory[i] == ref(i) ? gap + 1 : 0;
+        int len = i - gap - start;
+
+        w.put32(start);
+        w.put32(len);
+        w.put(m_memory + start, len);
+    }
+    w.put32(0);
+    w.put32(0);
+
+    // Draw state, audio and input
+    w.put(&m_color, sizeof(m_color));
+    w.put(&m_camera, sizeof(m_camera));
+    w.put(&m_cursor, sizeof(m_cursor));
+    w.put(&m_clip, sizeof(m_clip));
+    w.put(m_pal, sizeof(m_pal));
+    w.put(m_palt, sizeof(m_palt));
+    w.put(&m_fillp, sizeof(m_fillp));
+    w.put(&m_fillp_trans, sizeof(m_fillp_trans));
+    for (auto const &ch : m_channels)
+    {
+        w.put(&ch.m_sfx, sizeof(ch.m_sfx));
+        w.put(&ch.m_offset, sizeof(ch.m_offset));
+        w.put(&ch.m_phi, sizeof(ch.m_phi));
+    }
+    w.put(&m_button_state, sizeof(m_button_state));
+    w.put(m_button_frames, sizeof(m_button_frames));
+    w.put(&m_seed, sizeof(m_seed));
+    w.put(&m_uses_time, sizeof(m_uses_time));
+
+    // Lua globals
+    lua_pushcfunction(l, &save_globals);
+    lua_pushlightuserdata(l, &w);
+    bool ret = lua_pcall(l, 1, 1, 0) == LUA_OK && lua_toboolean(l, -1);
+    lua_pop(l, 1);
+
+    m_save_error = ret ? nullptr : w.m_error ? w.m_error : "error while saving";
+    return ret;
+}
+
+bool vm::restore(lol::array<uint8_t> const &blob)
+{
+    lua_State *l = GetLuaState();
+    state_reader r(blob.data(), blob.count());
+
+    char magic[sizeof(state_magic)];
+    if (!r.get(magic, sizeof(magic)) || ::memcmp(magic, state_magic, sizeof(magic)))
+        return false;
+
+    // Memory, patched over the cart ROM
+    lol::array<uint8_t> const &rom = m_cart->get_rom();
+    int rom_size = lol::min(rom.count(), (int)OFFSET_CODE);
+    ::memset(m_memory, 0, sizeof(m_memory));
+    ::memcpy(m_memory, rom.data(), rom_size);
+
+    for (;;)
+    {
+        uint32_t start, len;
+        if (!r.get32(start) || !r.get32(len) || start + (uint64_t)len > SIZE_MEMORY)
+            return false;
+        if (!len)
+            break;
+        if (!r.get(m_memory + start, len))
+            return false;
+    }
+
+    bool ok = r.get(&m_color, sizeof(m_color))
+           && r.get(&m_camera, sizeof(m_camera))
+           && r.get(&m_cursor, sizeof(m_cursor))
+           && r.get(&m_clip, sizeof(m_clip))
+           && r.get(m_pal, sizeof(m_pal))
+           && r.get(m_palt, sizeof(m_palt))
+           && r.get(&m_fillp, sizeof(m_fillp))
+           && r.get(&m_fillp_trans, sizeof(m_fillp_trans));
+    for (auto &ch : m_channels)
+        ok = ok && r.get(&ch.m_sfx, sizeof(ch.m_sfx))
+                && r.get(&ch.m_offset, sizeof(ch.m_offset))
+                && r.get(&ch.m_phi, sizeof(ch.m_phi));
+    ok = ok && r.get(&m_button_state, sizeof(m_button_state))
+            && r.get(m_button_frames, sizeof(m_button_frames))
+            && r.get(&m_seed, sizeof(m_seed))
+            && r.get(&m_uses_time, sizeof(m_uses_time));
+    if (!ok)
+        return false;
+
+    m_lut_format = -1;
+    dirty(0, 127);
+
+    // Lua globals, and a new main loop
+    lua_pushcfunction(l, &restore_globals);
+    lua_pushlightuserdata(l, &r);
+    if (lua_pcall(l, 1, 1, 0) != LUA_OK)
+    {
+        msg::error("cannot restore state: %s\n", lua_tostring(l, -1));
+        lua_pop(l, 1);
+        return false;
+    }
+    ok = lua_toboolean(l, -1);
+    lua_pop(l, 1);
+    if (ok)
+        take_loop(l);
+
+    return ok;
+}
+
+} // namespace z8
+
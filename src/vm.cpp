@@ -12,6 +12,8 @@
 
 #include <lol/engine.h>
 
+#include <mutex>
+
 #include "vm.h"
 
 namespace z8
@@ -19,11 +21,61 @@ namespace z8
 
 using lol::msg;
 
+// Load the font once and convert it to a 1bpp glyph table
+static uint8_t const (*get_font())[5]
+{
+    static uint8_t glyphs[0x7a][5];
+    static std::once_flag once;
+
+    std::call_once(once, []()
+    {
+        lol::Image font;
+        font.Load("data/font.png");
+        auto pixels = font.Lock<lol::PixelFormat::RGBA_8>();
+        for (int index = 0; index < 0x7a; ++index)
+        {
+            int w = index < 0x60 ? 4 : 8;
+            int h = 6;
+
+            for (int dy = 0; dy < h - 1; ++dy)
+            {
+                uint8_t bits = 0;
+                for (int dx = 0; dx < w - 1; ++dx)
+                    if (pixels[(index / 16 * h + dy) * 128 + (index % 16 * w + dx)].r > 0)
+                        bits |= 1 << dx;
+                glyphs[index][dy] = bits;
+            }
+        }
+        font.Unlock(pixels);
+    });
+
+    return glyphs;
+}
+
 vm::vm()
-  : m_instructions(0)
+  : m_fillp(0),
+    m_fillp_trans(false),
+    m_lut_format(-1),
+    m_button_state(0),
+    m_uses_time(false),
+    m_exact_memory(false),
+    m_echo(false),
+    m_loop(LUA_NOREF),
+    m_save_error(nullptr),
+    m_cycles(0.0),
+    m_frame_cycles(0.0),
+    m_budget(default_budget),
+    m_frame_budget(cpu_frequency / 30),
+    m_time_budget(0.0),
+    m_exhausted(false),
+    m_gc_running(false),
+    m_gc_time(0.0)
 {
     lua_State *l = GetLuaState();
 
+    // All further Lua allocations come from our arena
+    install(l);
+
     // Store a pointer to us in global state
     set_this(l);
 
@@ -34,12 +86,24 @@ vm::vm()
     lol::LuaObjectHelper::Register<vm>(l);
 
     ExecLuaFile("data/zepto8.lua");
+    mark_pristine();
 
-    // Load font
-    m_font.Load("data/font.png");
+    m_font = get_font();
+    m_cart = std::make_shared<cart>();
 
     // Clear memory
     ::memset(get_mem(), 0, SIZE_MEMORY);
+    ::memset(m_button_frames, 0, sizeof(m_button_frames));
+
+    set_memory_limit(default_memory_limit);
+
+    // From now on, garbage is only collected by step(), or when an
+    // allocation fails; explicit steps follow the step multiplier.
+    lua_gc(l, LUA_GCSTOP, 0);
+    lua_gc(l, LUA_GCSETSTEPMUL, gc_stepmul);
+    m_gc_threshold = used() / 100 * gc_pause;
+    m_gc_allocated = allocated();
+    dirty(0, 127);
 }
 
 vm::~vm()
@@ -64,15 +128,67 @@ void vm::hook(lua_State *l, lua_Debug *)
 {
     vm *that = get_this(l);
 
-    // The value 135000 was found using trial and error
-    that->m_instructions += 1000;
-    if (that->m_instructions >= 135000)
+    that->charge(1000 * that->m_costs.instruction);
+    if (that->m_cycles >= that->m_budget
+         || (that->m_time_budget > 0.0
+              && std::chrono::steady_clock::now() >= that->m_deadline))
+    {
+        that->m_exhausted = true;
         lua_yield(l, 0);
+    }
+}
+
+// Account for work done by the cart; the budget is only checked by the
+// hook, so API functions never yield
+void vm::charge(double cycles)
+{
+    m_cycles += cycles;
+    m_frame_cycles += cycles;
+}
+
+void vm::set_budget(int cycles, double seconds)
+{
+    m_budget = lol::max(cycles, 1000);
+    m_time_budget = lol::max(seconds, 0.0);
 }
 
 void vm::load(char const *name)
 {
-    m_cart.load(name);
+    std::shared_ptr<cart> c = std::make_shared<cart>();
+    c->load(name);
+    m_cart = c;
+    m_bytecode.reset();
+}
+
+void vm::load(std::shared_ptr<cart const> cart,
+              std::shared_ptr<lol::array<uint8_t> const> bytecode)
+{
+    m_cart = cart;
+    m_bytecode = bytecode;
+}
+
+static int dump(lua_State *l, void const *data, size_t size, void *ud)
+{
+    UNUSED(l);
+    lol::array<uint8_t> &bytecode = *(lol::array<uint8_t> *)ud;
+    for (size_t i = 0; i < size; ++i)
+        bytecode << ((uint8_t const *)data)[i];
+    return 0;
+}
+
+bool vm::compile(lol::array<uint8_t> &bytecode)
+{
+    lua_State *l = GetLuaState();
+    if (luaL_loadstring(l, m_cart->get_lua().C()) != LUA_OK)
+    {
+        lua_pop(l, 1);
+        return false;
+    }
+
+    bytecode.empty();
+    lua_dump(l, &dump, &bytecode, 0);
+    lua_pop(l, 1);
+    return true;
 }
 
 void vm::run()
@@ -81,17 +197,154 @@ void vm::run()
     ExecLuaCode("run()");
 }
 
-void vm::step(float seconds)
+static std::chrono::steady_clock::duration to_duration(double seconds)
 {
-    UNUSED(seconds);
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+               std::chrono::duration<double>(seconds));
+}
 
+void vm::step(float seconds)
+{
     lua_State *l = GetLuaState();
-    lua_getglobal(l, "_z8");
-    lua_getfield(l, -1, "tick");
-    lua_pcall(l, 0, 0, 0);
-    lua_remove(l, -1);
+    auto start = std::chrono::steady_clock::now();
+
+    m_exhausted = false;
+    if (m_time_budget > 0.0)
+        m_deadline = start + to_duration(m_time_budget);
+
+    // Resume the main loop until the end of the frame, or until the hook
+    // yields; it stays on the stack meanwhile, because a cart calling
+    // run() replaces it and drops our reference.
+    if (m_loop != LUA_NOREF)
+    {
+        lua_rawgeti(l, LUA_REGISTRYINDEX, m_loop);
+        lua_State *co = lua_tothread(l, -1);
+        int status = lua_resume(co, l, 0);
+        if (status != LUA_YIELD)
+        {
+            if (status != LUA_OK)
+                msg::error("%s\n", lua_tostring(co, -1));
+
+            // The main loop is dead, unless it was replaced
+            lua_rawgeti(l, LUA_REGISTRYINDEX, m_loop);
+            if (lua_tothread(l, -1) == co)
+                take_loop(l, false);
+            lua_pop(l, 1);
+        }
+        lua_pop(l, 1);
+    }
+
+    m_cycles = 0.0;
 
-    m_instructions = 0;
+    // Collect garbage in what is left of the frame
+    double frame = m_time_budget > 0.0 ? lol::min((double)seconds, m_time_budget)
+                                       : (double)seconds;
+    collect(start + to_duration(frame));
+}
+
+// Keep a reference to the main loop coroutine created by _z8.run() or
+// _z8.resume() so that step() does not need to look it up, or drop it
+void vm::take_loop(lua_State *l, bool take)
+{
+    luaL_unref(l, LUA_REGISTRYINDEX, m_loop);
+    m_loop = LUA_NOREF;
+
+    if (take)
+    {
+        lua_getglobal(l, "_z8");
+        lua_getfield(l, -1, "loop");
+        if (lua_isthread(l, -1))
+            m_loop = luaL_ref(l, LUA_REGISTRYINDEX);
+        else
+            lua_pop(l, 1);
+        lua_pop(l, 1);
+    }
+}
+
+// Garbage is collected between frames rather than whenever the cart
+// allocates: first as much work as the automatic collector would have
+// done for what the cart allocated during the frame, then more for as
+// long as the frame has time left.
+void vm::collect(std::chrono::steady_clock::time_point deadline)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // Like the automatic collector, wait for the heap to grow enough
+    // since the last cycle before starting a new one
+    if (m_gc_running || used() >= m_gc_threshold)
+    {
+        gc_step((int)((allocated() - m_gc_allocated) / 1024));
+        while (m_gc_running && std::chrono::steady_clock::now() < deadline)
+            gc_step(0);
+    }
+    m_gc_allocated = allocated();
+
+    m_gc_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// One step of the incremental collector, with “kb” of allocation debt,
+// or a single small step if 0
+void vm::gc_step(int kb)
+{
+    if (lua_gc(GetLuaState(), LUA_GCSTEP, kb))
+    {
+        m_gc_running = false;
+        m_gc_threshold = used() / 100 * gc_pause;
+    }
+    else
+    {
+        m_gc_running = true;
+    }
+}
+
+vm::memory_stats vm::memory_usage() const
+{
+    memory_stats ret;
+
+    ret.object = sizeof(vm);
+    ret.ram = sizeof(m_memory);
+    ret.cache = sizeof(m_lut);
+    ret.input = sizeof(m_button_state) + sizeof(m_button_frames) + sizeof(m_mouse);
+    ret.audio = sizeof(m_channels);
+
+    // The arena keeps count, so this does not need a collection
+    ret.lua = used();
+
+    ret.shared = sizeof(uint8_t[0x7a][5]);
+    if (m_cart)
+        ret.shared += m_cart->get_rom().count() + m_cart->get_code().count();
+    if (m_bytecode)
+        ret.shared += m_bytecode->count();
+
+    ret.total = ret.object + ret.lua;
+    return ret;
+}
+
+void vm::take_dirty(uint64_t mask[2])
+{
+    mask[0] = m_dirty[0];
+    mask[1] = m_dirty[1];
+    m_dirty[0] = m_dirty[1] = 0;
+}
+
+// Mark screen rows y1 to y2 (inclusive) as modified
+void vm::dirty(int y1, int y2)
+{
+    for (int n = 0; n < 2; ++n)
+    {
+        int lo = lol::max(y1 - 64 * n, 0), hi = lol::min(y2 - 64 * n, 63);
+        if (lo <= hi)
+            m_dirty[n] |= (~uint64_t(0) >> (63 - hi + lo)) << lo;
+    }
+}
+
+// Mark the screen rows overlapping a memory range as modified
+void vm::dirty_mem(int offset, int size)
+{
+    int start = lol::max(offset, (int)OFFSET_SCREEN);
+    int end = lol::min(offset + size, (int)OFFSET_END);
+    if (start < end)
+        dirty((start - OFFSET_SCREEN) / 64, (end - 1 - OFFSET_SCREEN) / 64);
 }
 
 const lol::LuaObjectLibrary* vm::GetLib()
@@ -113,6 +366,8 @@ const lol::LuaObjectLibrary* vm::GetLib()
             { "dset",     &vm::api::dset },
             { "stat",     &vm::api::stat },
             { "printh",   &vm::api::printh },
+            { "_begin_frame", &vm::api::begin_frame },
+            { "_start_clock", &vm::api::start_clock },
 
             { "_update_buttons", &vm::api::update_buttons },
             { "btn",  &vm::api::btn },
@@ -147,14 +402,18 @@ const lol::LuaObjectLibrary* vm::GetLib()
             { "cls",      &vm::api::cls },
             { "color",    &vm::api::color },
             { "fget",     &vm::api::fget },
+            { "fillp",    &vm::api::fillp },
             { "fset",     &vm::api::fset },
             { "line",     &vm::api::line },
             { "map",      &vm::api::map },
             { "mget",     &vm::api::mget },
             { "mset",     &vm::api::mset },
+            { "oval",     &vm::api::oval },
+            { "ovalfill", &vm::api::ovalfill },
             { "pal",      &vm::api::pal },
             { "palt",     &vm::api::palt },
             { "pget",     &vm::api::pget },
+            { "polyfill", &vm::api::polyfill },
             { "pset",     &vm::api::pset },
             { "rect",     &vm::api::rect },
             { "rectfill", &vm::api::rectfill },
@@ -162,6 +421,8 @@ const lol::LuaObjectLibrary* vm::GetLib()
             { "sset",     &vm::api::sset },
             { "spr",      &vm::api::spr },
             { "sspr",     &vm::api::sspr },
+            { "tline",    &vm::api::tline },
+            { "trifill",  &vm::api::trifill },
 
             { "music", &vm::api::music },
             { "sfx",   &vm::api::sfx },
@@ -201,13 +462,20 @@ int vm::api::run(lua_State *l)
     vm *that = get_this(l);
 
     // Initialise VM state (TODO: check what else to init)
-    ::memset(that->m_buttons, 0, sizeof(that->m_buttons));
+    that->m_button_state = 0;
+    ::memset(that->m_button_frames, 0, sizeof(that->m_button_frames));
 
     // Load cartridge code and call _z8.run() on it
     lua_getglobal(l, "_z8");
     lua_getfield(l, -1, "run");
-    luaL_loadstring(l, that->m_cart.get_lua().C());
+    if (that->m_bytecode && that->m_bytecode->count())
+        luaL_loadbufferx(l, (char const *)that->m_bytecode->data(),
+                         that->m_bytecode->count(), "=cart", "b");
+    else
+        luaL_loadstring(l, that->m_cart->get_lua().C());
     lua_pcall(l, 1, 0, 0);
+    lua_pop(l, 1);
+    that->take_loop(l);
 
     return 0;
 }
@@ -249,6 +517,8 @@ int vm::api::reload(lua_State *l)
         return luaL_error(l, "bad memory access");
 
     vm *that = get_this(l);
+    that->dirty_mem(dst, size);
+    that->charge(size * that->m_costs.memory_byte);
 
     // If reading from after the cart, fill with zeroes
     if (src > OFFSET_CODE)
@@ -262,7 +532,7 @@ int vm::api::reload(lua_State *l)
 
     // Now copy possibly legal data
     int amount = lol::min(size, OFFSET_CODE - src);
-    ::memcpy(that->get_mem(dst), that->m_cart.get_rom().data() + src, amount);
+    ::memcpy(that->get_mem(dst), that->m_cart->get_rom().data() + src, amount);
     dst += amount;
     size -= amount;
 
@@ -294,6 +564,7 @@ int vm::api::poke(lua_State *l)
 
     vm *that = get_this(l);
     that->m_memory[addr] = (uint8_t)val;
+    that->dirty_mem(addr, 1);
     return 0;
 }
 
@@ -314,6 +585,8 @@ int vm::api::memcpy(lua_State *l)
         return luaL_error(l, "bad memory access");
 
     vm *that = get_this(l);
+    that->dirty_mem(dst, size);
+    that->charge(size * that->m_costs.memory_byte);
 
     // If source is outside main memory, this will be memset(0). But we
     // delay the operation in case the source and the destinations overlap.
@@ -356,6 +629,8 @@ int vm::api::memset(lua_State *l)
 
     vm *that = get_this(l);
     ::memset(that->get_mem(dst), val, size);
+    that->dirty_mem(dst, size);
+    that->charge(size * that->m_costs.memory_byte);
 
     return 0;
 }
@@ -396,21 +671,30 @@ int vm::api::stat(lua_State *l)
 
     if (id == 0)
     {
-        // Perform a GC to avoid accounting for short lifespan objects.
-        // Not sure about the performance cost of this.
-        lua_gc(l, LUA_GCCOLLECT, 0);
-
         // From the PICO-8 documentation:
         // x:0 returns current Lua memory useage (0..1024MB)
-        int32_t fixed = ((int)lua_gc(l, LUA_GCCOUNT, 0) << 16)
-                      + ((int)lua_gc(l, LUA_GCCOUNTB, 0) << 6);
-        ret = fixed2double(fixed);
+        //
+        // The arena keeps count, so this is cheap enough to call every
+        // frame; the figure includes garbage not collected yet, unless
+        // exact mode asks for a full collection first. What the VM used
+        // before the cart started is left out, so that the figure reaches
+        // 2048 when the cart hits the memory limit.
+        if (that->m_exact_memory)
+            lua_gc(l, LUA_GCCOLLECT, 0);
+
+        // In KiB, as a 16:16 fixed point number
+        size_t used = lol::min(that->used_above_baseline(), (size_t)0x1ffffff);
+        ret = fixed2double((int32_t)(used << 6));
     }
     else if (id == 1)
     {
         // From the PICO-8 documentation:
         // x:1 returns cpu useage for last frame (1.0 means 100% at 30fps)
-        // TODO
+        //
+        // This is what the current frame used so far, so that carts
+        // calling it at the end of _draw() get the whole frame; Lua
+        // instructions are counted by the hook, 1000 at a time.
+        ret = that->m_frame_cycles / that->m_frame_budget;
     }
     else if (id >= 16 && id <= 19)
     {
@@ -452,6 +736,23 @@ int vm::api::printh(lua_State *l)
     return 0;
 }
 
+// Called by the main loop when a frame starts, with the frame rate
+int vm::api::begin_frame(lua_State *l)
+{
+    vm *that = get_this(l);
+    int fps = lua_toclamp64(l, 1) == 60 ? 60 : 30;
+    that->m_frame_cycles = 0.0;
+    that->m_frame_budget = cpu_frequency / fps;
+    return 0;
+}
+
+// Called when the cart starts, so that time() counts from there
+int vm::api::start_clock(lua_State *l)
+{
+    get_this(l)->m_timer.Get();
+    return 0;
+}
+
 //
 // I/O
 //
@@ -460,13 +761,15 @@ int vm::api::update_buttons(lua_State *l)
 {
     vm *that = get_this(l);
 
-    // Update button state
+    // Update button state; btnp() only needs to tell the first frame,
+    // and frames 16, 20, 24… so the count wraps from 19 back to 16.
     for (int i = 0; i < 64; ++i)
     {
-        if (that->m_buttons[1][i])
-            ++that->m_buttons[0][i];
+        uint8_t &frames = that->m_button_frames[i];
+        if (that->m_button_state & (uint64_t(1) << i))
+            frames = frames < 19 ? frames + 1 : 16;
         else
-            that->m_buttons[0][i] = 0;
+            frames = 0;
     }
 
     return 0;
@@ -480,13 +783,13 @@ int vm::api::btn(lua_State *l)
     {
         int bits = 0;
         for (int i = 0; i < 16; ++i)
-            bits |= that->m_buttons[0][i] ? 1 << i : 0;
+            bits |= that->m_button_frames[i] ? 1 << i : 0;
         lua_pushnumber(l, bits);
     }
     else
     {
         int index = (int)lua_tonumber(l, 1) + 8 * (int)lua_tonumber(l, 2);
-        lua_pushboolean(l, that->m_buttons[0][index]);
+        lua_pushboolean(l, that->m_button_frames[index]);
     }
 
     return 1;
@@ -511,13 +814,13 @@ int vm::api::btnp(lua_State *l)
     {
         int bits = 0;
         for (int i = 0; i < 16; ++i)
-            bits |= was_pressed(that->m_buttons[0][i]) ? 1 << i : 0;
+            bits |= was_pressed(that->m_button_frames[i]) ? 1 << i : 0;
         lua_pushnumber(l, bits);
     }
     else
     {
         int index = (int)lua_tonumber(l, 1) + 8 * (int)lua_tonumber(l, 2);
-        lua_pushboolean(l, was_pressed(that->m_buttons[0][index]));
+        lua_pushboolean(l, was_pressed(that->m_button_frames[index]));
     }
 
     return 1;
@@ -530,6 +833,7 @@ int vm::api::btnp(lua_State *l)
 int vm::api::time(lua_State *l)
 {
     vm *that = get_this(l);
+    that->m_uses_time = true;
     float time = lol::fmod(that->m_timer.Poll(), 65536.0f);
     lua_pushnumber(l, time < 32768.f ? time : time - 65536.0f);
     return 1;
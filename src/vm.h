@@ -14,8 +14,12 @@
 
 #include <lol/engine.h>
 
+#include <chrono>
+#include <memory>
+
 #include "zepto8.h"
 #include "cart.h"
+#include "arena.h"
 
 namespace z8
 {
@@ -25,7 +29,9 @@ using lol::u8vec4;
 
 class player;
 
-class vm : public lol::LuaLoader,
+// The arena comes first, so that it outlives the Lua state
+class vm : private arena,
+           public lol::LuaLoader,
            public lol::LuaObject
 {
     friend class z8::player;
@@ -36,16 +42,118 @@ public:
 
     void load(char const *name);
     void run();
+
+    // Share a cart that was already loaded, and optionally its code as
+    // compiled by compile(), which saves fixing and parsing it again;
+    // neither is modified by the VM
+    void load(std::shared_ptr<cart const> cart,
+              std::shared_ptr<lol::array<uint8_t> const> bytecode = nullptr);
+    bool compile(lol::array<uint8_t> &bytecode);
     void step(float seconds);
 
+    // Limits for each step(): the cart is interrupted, and resumes at the
+    // next step, after this many emulated CPU cycles or this many seconds,
+    // whichever comes first; 0 seconds means no time limit.
+    void set_budget(int cycles, double seconds);
+
+    // Emulated CPU speed, and the cycles available to one step at 60 fps
+    static int const cpu_frequency = 8000000;
+    static int const default_budget = cpu_frequency / 60;
+
+    // Cost in emulated CPU cycles of Lua instructions and of the work
+    // done by expensive API functions; stat(1) reports the cycles used
+    // during the current frame, and step() uses them for its budget.
+    struct cpu_costs
+    {
+        float instruction = 1.f;    // per Lua instruction
+        float fill_pixel = 0.25f;   // per pixel of cls() and rectfill()
+        float sprite_pixel = 0.5f;  // per pixel of spr(), sspr() and map()
+        float memory_byte = 0.125f; // per byte of memcpy(), memset(), reload()
+    };
+    void set_costs(cpu_costs const &costs) { m_costs = costs; }
+
+    // Lua memory available to the cart, on top of what the VM uses once
+    // initialised; beyond that, allocations raise “out of memory”. stat(0)
+    // counts from the same point. The default is the 2 MiB of PICO-8.
+    void set_memory_limit(size_t bytes) { set_limit(bytes); }
+    static size_t const default_memory_limit = 2 << 20;
+
+    // Have stat(0) run a full garbage collection before measuring, so
+    // that the result does not depend on when the collector last ran;
+    // this is slow, and meant for conformance tests.
+    void set_exact_memory(bool exact) { m_exact_memory = exact; }
+
+    // Also write the text drawn by print() to stdout, so that test carts
+    // can be run without a display
+    void set_echo(bool echo) { m_echo = echo; }
+
+    // Whether the last step() was interrupted by its budget
+    bool exhausted() const { return m_exhausted; }
+
+    // Seconds spent collecting garbage at the end of the last step()
+    double gc_time() const { return m_gc_time; }
+
+    // Save the VM state between two frames, including the Lua globals
+    // and what they reference, to a blob that restore() accepts on a VM
+    // that loaded the same cart. Fails if called during a frame, or if
+    // the cart holds values that cannot be saved, such as coroutines.
+    bool save(lol::array<uint8_t> &blob);
+    bool restore(lol::array<uint8_t> const &blob);
+
+    // Why the last save() failed, or nullptr; save_busy means it was
+    // called during a frame, anything else names a value that cannot be
+    // saved, and saving keeps failing until the cart drops it
+    char const *save_error() const { return m_save_error; }
+    static char const *const save_busy;
+
     uint8_t *get_mem(int offset = 0) { return &m_memory[offset]; }
     uint8_t const *get_mem(int offset = 0) const { return &m_memory[offset]; }
 
+    // Output pixel formats for render()
+    enum class pixel_format : int
+    {
+        rgba,    // 32 bits per pixel, bytes in R, G, B, A order
+        bgra,    // 32 bits per pixel, bytes in B, G, R, A order
+        rgb565,  // 16 bits per pixel, native endianness
+        indexed, // 8 bits per pixel, palette index
+        yuv420,  // 8-bit planar Y, then U and V planes at half resolution
+    };
+
     void render(lol::u8vec4 *screen) const;
-    void print_ansi(lol::ivec2 term_size = lol::ivec2(128, 128),
-                    uint8_t const *prev_screen = nullptr) const;
+    void render(void *buffer, int stride, pixel_format format) const;
+
+    // The display palette set by pal(c0, c1, 1)
+    uint8_t const *get_display_pal() const { return m_pal[1]; }
+
+    // Screen rows modified since the last call, as a 128-bit mask where
+    // bit n % 64 of mask[n / 64] is row n; the mask is cleared on return.
+    void take_dirty(uint64_t mask[2]);
+
+    // Memory used by this VM, in bytes
+    struct memory_stats
+    {
+        size_t total;  // what this VM costs: object plus Lua heap
+        size_t object; // sizeof(vm), which includes:
+        size_t ram;    //   PICO-8 memory
+        size_t cache;  //   rendering cache
+        size_t input;  //   button and mouse state
+        size_t audio;  //   audio channels
+        size_t lua;    // Lua heap, including garbage not collected yet
+        size_t shared; // font, cart and compiled code, maybe shared
+    };
 
-    void button(int index, int state) { m_buttons[1][index] = state; }
+    memory_stats memory_usage() const;
+
+    // Whether any sound is playing, and whether the cart ever called
+    // time(), for idle detection by hosts
+    bool is_silent() const;
+    bool uses_time() const { return m_uses_time; }
+
+    void button(int index, int state)
+    {
+        uint64_t bit = uint64_t(1) << index;
+        m_button_state = state ? m_button_state | bit : m_button_state & ~bit;
+    }
     void mouse(lol::ivec2 coords, int buttons) { m_mouse = lol::ivec3(coords, buttons); }
 
     static const lol::LuaObjectLibrary* GetLib();
@@ -55,6 +163,18 @@ private:
     void set_this(lua_State *l);
     static vm* get_this(lua_State *l);
     static void hook(lua_State *l, lua_Debug *ar);
+    void charge(double cycles);
+    void mark_pristine();
+
+    void take_loop(lua_State *l, bool take = true);
+    void collect(std::chrono::steady_clock::time_point deadline);
+    void gc_step(int kb);
+
+    // A new collection cycle starts when the heap reaches this percentage
+    // of its size after the previous one; steps do this percentage of the
+    // work needed for what was allocated, like the automatic collector.
+    static int const gc_pause = 200;
+    static int const gc_stepmul = 200;
 
     struct api
     {
@@ -71,6 +191,8 @@ private:
         static int dset(lua_State *l);
         static int stat(lua_State *l);
         static int printh(lua_State *l);
+        static int begin_frame(lua_State *l);
+        static int start_clock(lua_State *l);
 
         // I/O
         static int update_buttons(lua_State *l);
@@ -111,14 +233,18 @@ private:
         static int cls(lua_State *l);
         static int color(lua_State *l);
         static int fget(lua_State *l);
+        static int fillp(lua_State *l);
         static int fset(lua_State *l);
         static int line(lua_State *l);
         static int map(lua_State *l);
         static int mget(lua_State *l);
         static int mset(lua_State *l);
+        static int oval(lua_State *l);
+        static int ovalfill(lua_State *l);
         static int pal(lua_State *l);
         static int palt(lua_State *l);
         static int pget(lua_State *l);
+        static int polyfill(lua_State *l);
         static int pset(lua_State *l);
         static int rect(lua_State *l);
         static int rectfill(lua_State *l);
@@ -126,6 +252,8 @@ private:
         static int sset(lua_State *l);
         static int spr(lua_State *l);
         static int sspr(lua_State *l);
+        static int tline(lua_State *l);
+        static int trifill(lua_State *l);
 
         // Sound
         static int music(lua_State *l);
@@ -138,28 +266,61 @@ private:
 private:
     int getpixel(int x, int y);
     void setpixel(int x, int y, int color);
+    void plot(int x, int y, int color);
+
+    void dirty(int y1, int y2);
+    void dirty_mem(int offset, int size);
+
+    int fill_color() const;
+    int clipped_area(int x, int y, int w, int h) const;
+    int pattern_color(int x, int y, int color) const;
 
     void hline(int x1, int x2, int y, int color);
     void vline(int x, int y1, int y2, int color);
 
+    void draw_spans(int y, lol::ivec2 const *spans, int count,
+                    bool fill, int color);
+    void circle(int x, int y, int r, bool fill, int color);
+    void ellipse(int x0, int y0, int x1, int y1, bool fill, int color);
+    void polygon(double const *coords, int count, int color);
+
     int getspixel(int x, int y);
     void setspixel(int x, int y, int color);
 
     void getaudio(int channel, void *buffer, int bytes);
 
+    void update_lut(pixel_format format) const;
+
 private:
     uint8_t m_memory[SIZE_MEMORY];
-    lol::Image m_font;
-    cart m_cart;
+    uint64_t m_dirty[2];
+
+    // Font glyphs for characters 0x20 to 0x99, as five 1bpp rows each;
+    // bit n of a row is the pixel in column n. Shared by all VMs.
+    uint8_t const (*m_font)[5];
+
+    // Shared, read-only cart data
+    std::shared_ptr<cart const> m_cart;
+    std::shared_ptr<lol::array<uint8_t> const> m_bytecode;
 
     // Graphics
     uint8_t m_color;
     lol::ivec2 m_camera, m_cursor;
     lol::ibox2 m_clip;
     uint8_t m_pal[2][16], m_palt[16];
-
-    // Input
-    int m_buttons[2][64];
+    uint16_t m_fillp;
+    bool m_fillp_trans;
+
+    // Rendering cache: output bytes for the two pixels of each possible
+    // screen byte, for the display palette and format it was built for.
+    mutable uint8_t m_lut[256][8];
+    mutable uint8_t m_lut_pal[16];
+    mutable int m_lut_format;
+
+    // Input: buttons currently down, and for how many frames each one
+    // was seen down by the cart, see api::update_buttons()
+    uint64_t m_button_state;
+    uint8_t m_button_frames[64];
     lol::ivec3 m_mouse;
 
     // Audio
@@ -178,8 +339,28 @@ private:
     struct sfx const &get_sfx(int n) const;
 
     lol::Timer m_timer;
+    bool m_uses_time, m_exact_memory, m_echo;
     uint32_t m_seed;
-    int m_instructions;
+
+    // Registry reference to the main loop coroutine, see take_loop()
+    int m_loop;
+    char const *m_save_error;
+
+    // Emulated CPU cycles used by the current step, with its budget, and
+    // by the current frame, which lasts one or two steps depending on
+    // the frame rate; fractions of a cycle add up across calls
+    cpu_costs m_costs;
+    double m_cycles, m_frame_cycles;
+    int m_budget, m_frame_budget;
+    double m_time_budget;
+    std::chrono::steady_clock::time_point m_deadline;
+    bool m_exhausted;
+
+    // Garbage collection state
+    bool m_gc_running;
+    size_t m_gc_threshold;
+    uint64_t m_gc_allocated;
+    double m_gc_time;
 };
 
 // Clamp a double to the nearest value that can be represented as a 16:16
@@ -16,12 +16,16 @@
 
 #include <lol/engine.h>
 
+#include <csignal>
 #include <fstream>
 #include <sstream>
 
 #include "zepto8.h"
 #include "vm.h"
+#include "ansi.h"
 #include "telnet.h"
+#include "server.h"
+#include "probe.h"
 
 enum class mode
 {
@@ -36,15 +40,39 @@ enum class mode
 
     out    = 'o',
     data   = 136,
+    serve  = 137,
+    watch  = 138,
+    zlib   = 139,
+    encode = 140,
+    offload = 141,
+    test   = 142,
+    frames = 143,
+    probe  = 144,
+    clients = 145,
+    exact  = 146,
 };
 
+// Set by SIGINT and SIGTERM so that --run can restore the terminal
+static volatile sig_atomic_t quit = 0;
+
+static void on_signal(int)
+{
+    quit = 1;
+}
+
 static void usage()
 {
     printf("Usage: zeptool [--tolua|--topng|--top8|--todata] [--data <file>] <cart> [-o <file>]\n");
 #if HAVE_UNISTD_H
     printf("       zeptool --run <cart>\n");
+    printf("       zeptool --test [--frames <count>] [--exact-memory] <cart>\n");
     printf("       zeptool --telnet <cart>\n");
 #endif
+#if HAVE_SYS_EPOLL_H
+    printf("       zeptool --serve <port> [--watch <port>] [--compress <level>]\n");
+    printf("               [--encoder auto|ansi|sixel|kitty] [--offload <seconds>] <cart>\n");
+    printf("       zeptool --probe <port> [--clients <count>]\n");
+#endif
 }
 
 int main(int argc, char **argv)
@@ -57,15 +85,33 @@ int main(int argc, char **argv)
     opt.add_opt(int(mode::topng),  "topng",  false);
     opt.add_opt(int(mode::top8),   "top8",   false);
     opt.add_opt(int(mode::todata), "todata", false);
+    opt.add_opt(int(mode::test),   "test",   false);
+    opt.add_opt(int(mode::frames), "frames", true);
+    opt.add_opt(int(mode::exact),  "exact-memory", false);
     opt.add_opt(int(mode::out),    "out",    true);
     opt.add_opt(int(mode::data),   "data",   true);
 #if HAVE_UNISTD_H
     opt.add_opt(int(mode::telnet), "telnet", false);
 #endif
+#if HAVE_SYS_EPOLL_H
+    opt.add_opt(int(mode::serve),  "serve",  true);
+    opt.add_opt(int(mode::watch),  "watch",  true);
+    opt.add_opt(int(mode::zlib),   "compress", true);
+    opt.add_opt(int(mode::encode), "encoder", true);
+    opt.add_opt(int(mode::offload), "offload", true);
+    opt.add_opt(int(mode::probe),  "probe",  true);
+    opt.add_opt(int(mode::clients), "clients", true);
+#endif
 
     mode run_mode = mode::none;
     char const *data = nullptr;
     char const *out = nullptr;
+    int frames = 600;
+    bool exact_memory = false;
+#if HAVE_SYS_EPOLL_H
+    int port = 0, watch_port = 0, compression = 6, offload = 0, clients = 1;
+    char const *encoder = "auto";
+#endif
 
     for (;;)
     {
@@ -81,14 +127,46 @@ int main(int argc, char **argv)
         case (int)mode::todata:
         case (int)mode::run:
         case (int)mode::telnet:
+        case (int)mode::test:
             run_mode = mode(c);
             break;
+        case (int)mode::frames:
+            frames = atoi(opt.arg);
+            break;
+        case (int)mode::exact:
+            exact_memory = true;
+            break;
         case (int)mode::data:
             data = opt.arg;
             break;
         case (int)mode::out:
             out = opt.arg;
             break;
+#if HAVE_SYS_EPOLL_H
+        case (int)mode::serve:
+            run_mode = mode::serve;
+            port = atoi(opt.arg);
+            break;
+        case (int)mode::watch:
+            watch_port = atoi(opt.arg);
+            break;
+        case (int)mode::zlib:
+            compression = atoi(opt.arg);
+            break;
+        case (int)mode::encode:
+            encoder = opt.arg;
+            break;
+        case (int)mode::offload:
+            offload = atoi(opt.arg);
+            break;
+        case (int)mode::probe:
+            run_mode = mode::probe;
+            port = atoi(opt.arg);
+            break;
+        case (int)mode::clients:
+            clients = atoi(opt.arg);
+            break;
+#endif
         default:
             return EXIT_FAILURE;
         }
@@ -143,15 +221,42 @@ int main(int argc, char **argv)
     else if (run_mode == mode::run)
     {
         z8::vm vm;
+        z8::ansi ansi(lol::ivec2(128, 64));
         vm.load(cart_name);
         vm.run();
-        while (true)
+
+        signal(SIGINT, on_signal);
+        signal(SIGTERM, on_signal);
+        while (!quit)
         {
             lol::Timer t;
             vm.step(1.f / 60.f);
-            vm.print_ansi();
+
+            // Send the whole frame at once
+            lol::array<uint8_t> const &data = ansi.encode(vm);
+#if HAVE_UNISTD_H
+            write(STDOUT_FILENO, data.data(), data.count());
+#else
+            fwrite(data.data(), 1, data.count(), stdout);
+            fflush(stdout);
+#endif
             t.Wait(1.f / 60.f);
         }
+
+        printf("%s", ansi.teardown());
+        fflush(stdout);
+    }
+    else if (run_mode == mode::test)
+    {
+        // Run the cart as fast as possible without a display; whatever
+        // it prints goes to stdout
+        z8::vm vm;
+        vm.set_echo(true);
+        vm.set_exact_memory(exact_memory);
+        vm.load(cart_name);
+        vm.run();
+        for (int i = 0; i < frames; ++i)
+            vm.step(1.f / 60.f);
     }
 #if HAVE_UNISTD_H
     else if (run_mode == mode::telnet)
@@ -159,6 +264,20 @@ int main(int argc, char **argv)
         z8::telnet telnet;
         telnet.run(cart_name);
     }
+#endif
+#if HAVE_SYS_EPOLL_H
+    else if (run_mode == mode::serve && port > 0)
+    {
+        z8::server server(cart_name, port, watch_port, compression, encoder,
+                          offload);
+        server.run();
+    }
+    else if (run_mode == mode::probe && port > 0)
+    {
+        // Check a running server with scripted clients over loopback
+        z8::probe probe(port, clients);
+        return probe.run() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 #endif
     else
     {
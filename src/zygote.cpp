@@ -0,0 +1,138 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#include <lol/engine.h>
+
+#include <chrono>
+#include <cmath>
+
+#include "zygote.h"
+
+namespace z8
+{
+
+// How fast the take rate forgets about past takes, in seconds
+static double const rate_window = 10.0;
+
+static double clock()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+zygote::zygote(char const *cart, int min_size, int max_size)
+  : m_min_size(lol::max(min_size, 0)),
+    m_max_size(lol::max(max_size, m_min_size))
+{
+    std::shared_ptr<z8::cart> c = std::make_shared<z8::cart>();
+    m_valid = c->load(cart);
+    if (!m_valid)
+    {
+        lol::msg::error("cannot load cart %s\n", cart);
+        return;
+    }
+
+    // The cart and its compiled code are shared by all the VMs, and
+    // never modified; fix the code now, before threads start using it.
+    c->get_lua();
+    m_cart = c;
+
+    // Compile the cart once; if that fails, VMs get the source code and
+    // will report the error as usual.
+    std::shared_ptr<lol::array<uint8_t>> bytecode = std::make_shared<lol::array<uint8_t>>();
+    vm compiler;
+    compiler.load(m_cart);
+    if (compiler.compile(*bytecode))
+        m_bytecode = bytecode;
+
+    m_thread = std::thread(&zygote::work, this);
+}
+
+zygote::~zygote()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wake.notify_all();
+
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+std::unique_ptr<vm> zygote::take()
+{
+    std::unique_ptr<vm> ret;
+    if (!m_valid)
+        return ret;
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_ready.size())
+        {
+            ret = std::move(m_ready.front());
+            m_ready.pop_front();
+
+            double now = clock();
+            m_rate = m_rate * std::exp((m_last_take - now) / rate_window)
+                   + 1.0 / rate_window;
+            m_last_take = now;
+        }
+    }
+    m_wake.notify_all();
+
+    return ret;
+}
+
+int zygote::target(double now) const
+{
+    // Cover the takes expected while the next VMs are being built, with
+    // some margin for bursts
+    double rate = m_rate * std::exp((m_last_take - now) / rate_window);
+    int wanted = (int)std::ceil(2.0 * rate * m_build_time);
+    return lol::clamp(wanted, m_min_size, m_max_size);
+}
+
+vm *zygote::create() const
+{
+    vm *ret = new vm();
+    ret->load(m_cart, m_bytecode);
+    ret->run();
+    return ret;
+}
+
+void zygote::work()
+{
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [this]()
+            {
+                return m_quit || (int)m_ready.size() < target(clock());
+            });
+            if (m_quit)
+                return;
+        }
+
+        // Build outside the lock, so that take() never waits for us
+        double start = clock();
+        std::unique_ptr<vm> v(create());
+        double elapsed = clock() - start;
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_build_time = m_build_time > 0.0 ? 0.9 * m_build_time + 0.1 * elapsed : elapsed;
+        m_ready.push_back(std::move(v));
+    }
+}
+
+} // namespace z8
@@ -0,0 +1,75 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/engine.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "zepto8.h"
+#include "vm.h"
+
+namespace z8
+{
+
+//
+// Hand out VMs that are ready to run a cart. The cart is loaded and its
+// code compiled only once; a background thread then keeps VMs initialised
+// up to the point where the cart starts, so that a new session only has
+// to take one. VMs are never built on the caller's thread.
+//
+// The number of VMs kept ready follows demand: enough to cover the recent
+// rate of takes while the thread builds more, within [min_size, max_size].
+//
+
+class zygote
+{
+public:
+    zygote(char const *cart, int min_size = 2, int max_size = 32);
+    ~zygote();
+
+    // Whether the cart could be loaded; take() never succeeds otherwise
+    bool valid() const { return m_valid; }
+
+    // A new VM that already ran run(), or an empty pointer if none is
+    // ready yet; callers should try again on their next step.
+    std::unique_ptr<vm> take();
+
+private:
+    vm *create() const;
+    void work();
+    int target(double now) const;
+
+    std::shared_ptr<cart const> m_cart;
+    std::shared_ptr<lol::array<uint8_t> const> m_bytecode;
+    bool m_valid;
+    int m_min_size, m_max_size;
+
+    // Decaying count of takes, in takes per second, as of m_last_take;
+    // and the average time it takes to build a VM
+    double m_rate = 0.0, m_last_take = 0.0;
+    double m_build_time = 0.0;
+
+    std::deque<std::unique_ptr<vm>> m_ready;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::thread m_thread;
+    bool m_quit = false;
+};
+
+} // namespace z8
+